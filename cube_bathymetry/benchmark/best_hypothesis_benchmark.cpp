@@ -0,0 +1,88 @@
+#include <cube_bathymetry/node.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Times Node::bestHypothesis() with 1 to 16 hypotheses, against the
+// original search, which compared normalised absolute errors and so took
+// a sqrt per hypothesis.  A vectorised search was tried and was slower
+// than the scalar one at these sizes, since the divide per hypothesis
+// dominates.
+
+namespace
+{
+
+/// Keeps the searches from being optimised away
+volatile std::size_t sink;
+
+const cube::Hypothesis* originalBestHypothesis(const std::vector<cube::Hypothesis>& hypotheses, float depth, float variance)
+{
+  const cube::Hypothesis* ret = nullptr;
+  double min_error = std::numeric_limits<float>::max();
+  for(const auto& h: hypotheses)
+  {
+    double forecast_variance = h.predicted_variance + variance;
+    double error = std::abs(depth - h.predicted_estimate)/std::sqrt(forecast_variance);
+    if(error < min_error)
+    {
+      min_error = error;
+      ret = &h;
+    }
+  }
+  return ret;
+}
+
+template <typename Search>
+double nanosecondsPerSearch(const std::vector<std::pair<float, float> >& queries, int repeats, Search search)
+{
+  std::size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(int r = 0; r < repeats; r++)
+    for(const auto& q: queries)
+      total += search(q.first, q.second)->hypothesis_number;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  sink = total;
+  return seconds*1e9/(repeats*queries.size());
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::size_t count = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  const int repeats = 3;
+
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<double> uniform;
+  std::vector<std::pair<float, float> > queries;
+  for(std::size_t i = 0; i < count; i++)
+    queries.push_back(std::make_pair(18.0 + 9.0*uniform(generator), 0.01 + 0.1*uniform(generator)));
+
+  std::cout << "hypotheses  original (ns)  current (ns)  mismatches" << std::endl;
+  for(int n = 1; n <= 16; n++)
+  {
+    cube::Node node;
+    std::vector<cube::Hypothesis> hypotheses;
+    for(int i = 0; i < n; i++)
+    {
+      float depth = 20.0 + 5.0*uniform(generator);
+      float variance = 0.01 + 0.2*uniform(generator);
+      node.addHypothesis(depth, variance);
+      hypotheses.emplace_back(depth, variance);
+      hypotheses.back().hypothesis_number = i;
+    }
+
+    std::size_t mismatches = 0;
+    for(const auto& q: queries)
+      if(originalBestHypothesis(hypotheses, q.first, q.second)->hypothesis_number != node.bestHypothesis(q.first, q.second)->hypothesis_number)
+        mismatches++;
+
+    double original = nanosecondsPerSearch(queries, repeats, [&](float depth, float variance){return originalBestHypothesis(hypotheses, depth, variance);});
+    double current = nanosecondsPerSearch(queries, repeats, [&](float depth, float variance){return node.bestHypothesis(depth, variance);});
+    std::cout << n << "  " << original << "  " << current << "  " << mismatches << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <cube_bathymetry/geotiff_writer.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Times writeGeoTiff() on the same sheet as a plain tiled GeoTIFF and as
+// a cloud optimised one, and reports the size of each file.  The sheet
+// is a synthetic sloping seabed with a sand wave pattern, built from a
+// fixed seed so runs are comparable.
+
+namespace
+{
+
+std::size_t fileSize(const std::string& filename)
+{
+  std::FILE* file = std::fopen(filename.c_str(), "rb");
+  if(!file)
+    return 0;
+  std::fseek(file, 0, SEEK_END);
+  auto size = std::ftell(file);
+  std::fclose(file);
+  return size < 0 ? 0 : size;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  double extent = argc > 1 ? std::stod(argv[1]) : 500.0;
+  std::string prefix = argc > 2 ? argv[2] : "geotiff_write_benchmark";
+  const float resolution = 1.0;
+
+  cube::MapSheet sheet(cube::CellCounts(64), cube::CellSizes(resolution));
+
+  /* Four soundings per cell with 5 cm noise */
+  std::mt19937 generator(11);
+  std::normal_distribution<double> normal;
+  std::uniform_real_distribution<double> uniform;
+  std::vector<cube::Sounding> soundings;
+  auto start = std::chrono::steady_clock::now();
+  for(double y = 0.0; y < extent; y += resolution/2.0)
+  {
+    soundings.clear();
+    for(double x = 0.0; x < extent; x += resolution/2.0)
+    {
+      cube::Sounding s;
+      s.x = x + resolution*(uniform(generator) - 0.5)/2.0;
+      s.y = y + resolution*(uniform(generator) - 0.5)/2.0;
+      s.depth = 20.0 + 0.02*x + 0.5*std::sin(x/15.0)*std::cos(y/40.0) + 0.05*normal(generator);
+      s.vertical_error = 0.0025;
+      s.horizontal_error = 0.01;
+      soundings.push_back(s);
+    }
+    sheet.addSoundings(soundings);
+  }
+  std::cout << "built a " << extent << " m square sheet in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " seconds" << std::endl;
+
+  const std::string projection = "+proj=tmerc +lat_0=0 +lon_0=-69 +k=0.9996 +x_0=500000 +y_0=0 +datum=WGS84 +units=m +no_defs";
+  std::cout << "output  seconds  MB" << std::endl;
+  for(bool cloud_optimised: {false, true})
+  {
+    cube::GeoTiffOptions options;
+    options.cloud_optimised = cloud_optimised;
+    std::string filename = prefix + (cloud_optimised ? "_cog.tif" : "_plain.tif");
+    start = std::chrono::steady_clock::now();
+    cube::writeGeoTiff(sheet, filename, projection, options);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << (cloud_optimised ? "cloud optimised" : "plain") << "  " << seconds << "  " << fileSize(filename)/1.0e6 << std::endl;
+    std::remove(filename.c_str());
+  }
+  return 0;
+}
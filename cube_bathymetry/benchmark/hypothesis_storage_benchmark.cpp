@@ -0,0 +1,105 @@
+#include <cube_bathymetry/hypothesis.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Compares hypotheses kept in single and double precision on the same
+// samples: the memory each takes, the update time, and how far the
+// single precision estimates drift from the double precision ones.  Both
+// storage types are instantiated in the library whichever one
+// CUBE_FLOAT_HYPOTHESIS_STORAGE selects for Node.
+
+namespace
+{
+
+typedef std::vector<std::pair<float, float> > Samples;
+
+/// Track samples with a single hypothesis, starting a new one at each
+/// intervention as a node with a cap of one hypothesis does
+template <typename StorageT>
+std::vector<cube::BasicHypothesis<StorageT> > track(const std::vector<Samples>& tracks, const cube::Parameters& parameters, std::size_t& interventions, double& seconds)
+{
+  std::vector<cube::BasicHypothesis<StorageT> > ret;
+  ret.reserve(tracks.size());
+  interventions = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(const auto& samples: tracks)
+  {
+    cube::BasicHypothesis<StorageT> hypothesis(samples.front().first, samples.front().second);
+    for(std::size_t i = 1; i < samples.size(); i++)
+      if(!hypothesis.update(samples[i].first, samples[i].second, parameters))
+      {
+        interventions++;
+        hypothesis = cube::BasicHypothesis<StorageT>(samples[i].first, samples[i].second);
+      }
+    ret.push_back(hypothesis);
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return ret;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::size_t track_count = argc > 1 ? std::stoul(argv[1]) : 20000;
+  const std::size_t samples_per_track = 200;
+
+  /* Depths from 10 m to 6000 m with 1% of depth noise, so that float's
+   * precision is tested over the full range of survey depths, with
+   * outliers and a level shift on every tenth track
+   */
+  std::mt19937 generator(3);
+  std::normal_distribution<double> normal;
+  std::uniform_real_distribution<double> uniform;
+  std::vector<Samples> tracks(track_count);
+  for(std::size_t t = 0; t < tracks.size(); t++)
+  {
+    double depth = 10.0*std::pow(600.0, uniform(generator));
+    double sigma = 0.01*depth;
+    for(std::size_t i = 0; i < samples_per_track; i++)
+    {
+      double scale = uniform(generator) < 0.02 ? 8.0 : 1.0;
+      double shift = t%10 == 0 && i >= samples_per_track/2 ? 5.0*sigma : 0.0;
+      tracks[t].push_back(std::make_pair(depth + shift + scale*sigma*normal(generator), sigma*sigma));
+    }
+  }
+
+  cube::Parameters parameters(cube::CellSizes(1.0));
+  std::size_t double_interventions, float_interventions;
+  double double_seconds, float_seconds;
+  auto d = track<double>(tracks, parameters, double_interventions, double_seconds);
+  auto f = track<float>(tracks, parameters, float_interventions, float_seconds);
+
+  double maximum_relative_error = 0.0;
+  double sum_squared_relative_error = 0.0;
+  double maximum_uncertainty_error = 0.0;
+  std::size_t differing_samples = 0;
+  for(std::size_t i = 0; i < tracks.size(); i++)
+  {
+    if(d[i].number_of_samples != f[i].number_of_samples)
+    {
+      differing_samples++;
+      continue;
+    }
+    double relative_error = std::abs(f[i].current_estimate - d[i].current_estimate)/d[i].current_estimate;
+    maximum_relative_error = std::max(maximum_relative_error, relative_error);
+    sum_squared_relative_error += relative_error*relative_error;
+    double uncertainty_error = std::abs(std::sqrt(double(f[i].current_variance)) - std::sqrt(d[i].current_variance))/std::sqrt(d[i].current_variance);
+    maximum_uncertainty_error = std::max(maximum_uncertainty_error, uncertainty_error);
+  }
+  double rms_relative_error = std::sqrt(sum_squared_relative_error/(tracks.size() - differing_samples));
+  double updates = double(tracks.size())*(samples_per_track - 1);
+
+  std::cout << "storage  bytes/hypothesis  ns/update  interventions" << std::endl;
+  std::cout << "double  " << sizeof(cube::BasicHypothesis<double>) << "  " << double_seconds*1e9/updates << "  " << double_interventions << std::endl;
+  std::cout << "float  " << sizeof(cube::BasicHypothesis<float>) << "  " << float_seconds*1e9/updates << "  " << float_interventions << std::endl;
+  std::cout << "Node uses " << (sizeof(cube::Hypothesis) == sizeof(cube::BasicHypothesis<float>) ? "float" : "double") << " storage in this build" << std::endl;
+  std::cout << "float against double: depth relative error max " << maximum_relative_error << ", rms " << rms_relative_error
+            << "; uncertainty relative error max " << maximum_uncertainty_error
+            << "; " << differing_samples << " of " << tracks.size() << " tracks ended on different hypotheses" << std::endl;
+  return 0;
+}
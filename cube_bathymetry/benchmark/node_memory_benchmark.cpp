@@ -0,0 +1,96 @@
+#include <cube_bathymetry/node.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <vector>
+
+// Measures the heap used by a set of nodes fed through the median
+// pre-filter, with the queues full and after they are flushed, for
+// several maximum_hypotheses caps.  One node in ten sees a level shift
+// halfway through, so that it proposes more hypotheses.
+
+namespace
+{
+
+/// Bytes currently allocated through operator new
+std::size_t live_bytes = 0;
+
+/// Each allocation is prefixed with its size, padded to keep alignment
+const std::size_t header_size = alignof(std::max_align_t);
+
+} // namespace
+
+void* operator new(std::size_t size)
+{
+  auto block = static_cast<char*>(std::malloc(size + header_size));
+  if(!block)
+    throw std::bad_alloc();
+  *reinterpret_cast<std::size_t*>(block) = size;
+  live_bytes += size;
+  return block + header_size;
+}
+
+void operator delete(void* p) noexcept
+{
+  if(!p)
+    return;
+  auto block = static_cast<char*>(p) - header_size;
+  live_bytes -= *reinterpret_cast<std::size_t*>(block);
+  std::free(block);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  operator delete(p);
+}
+
+int main(int argc, char *argv[])
+{
+  std::size_t node_count = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const std::size_t samples_per_node = 40;
+
+  std::mt19937 generator(7);
+  std::normal_distribution<double> normal;
+  std::uniform_real_distribution<double> uniform;
+
+  std::cout << "Node is " << sizeof(cube::Node) << " bytes, Hypothesis " << sizeof(cube::Hypothesis) << " bytes" << std::endl;
+  std::cout << "cap  queued (bytes/node)  flushed (bytes/node)  multiple hypotheses  seconds" << std::endl;
+  for(uint32_t cap: {0u, 4u, 2u, 1u})
+  {
+    cube::Parameters parameters(cube::CellSizes(1.0));
+    parameters.maximum_hypotheses = cap;
+    generator.seed(7);
+
+    std::size_t baseline = live_bytes;
+    auto start = std::chrono::steady_clock::now();
+    {
+      std::vector<cube::Node> nodes(node_count);
+      for(std::size_t i = 0; i < nodes.size(); i++)
+      {
+        bool shifted = i%10 == 0;
+        for(std::size_t s = 0; s < samples_per_node; s++)
+        {
+          float variance = 0.01 + 0.04*uniform(generator);
+          double depth = 20.0 + (shifted && s >= samples_per_node/2 ? 2.0 : 0.0) + normal(generator)*std::sqrt(variance);
+          nodes[i].queueEstimate(depth, variance, parameters);
+        }
+      }
+      double queued = double(live_bytes - baseline)/nodes.size();
+
+      std::size_t multiple = 0;
+      for(auto& node: nodes)
+      {
+        node.queueFlush(parameters);
+        if(node.hypothesisCount() > 1)
+          multiple++;
+      }
+      double flushed = double(live_bytes - baseline)/nodes.size();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      std::cout << cap << "  " << queued << "  " << flushed << "  " << multiple << "  " << seconds << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef CUBE_BATHYMETRY_BAG_WRITER_H
+#define CUBE_BATHYMETRY_BAG_WRITER_H
+
+#include "map_sheet.h"
+#include <string>
+
+namespace cube
+{
+
+/// Write the surface of sheet to a Bathymetric Attributed Grid (BAG)
+/// through GDAL's BAG driver, which needs GDAL 2.4 or later.  Each grid
+/// is extracted and written in turn, with the HDF5 chunks the size of a
+/// grid, so neither the whole surface nor an intermediate GeoTIFF is
+/// needed.
+///
+/// BAG elevations are positive up, so depths are negated.  The
+/// uncertainty is the confidence interval CUBE reports.  Cells without
+/// data hold the BAG null value, 1000000.  projection is the WKT, EPSG
+/// code or proj string of the map frame of the sheet, and is converted
+/// to WKT for GDAL.  The BAG driver needs a projected coordinate system.
+/// Throws std::runtime_error if the projection can't be converted or
+/// GDAL fails.
+void writeBag(const MapSheet& sheet, const std::string& filename, const std::string& projection);
+
+} // namespace cube
+
+#endif
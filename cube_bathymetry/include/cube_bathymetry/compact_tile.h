@@ -0,0 +1,97 @@
+#ifndef CUBE_BATHYMETRY_COMPACT_TILE_H
+#define CUBE_BATHYMETRY_COMPACT_TILE_H
+
+#include "common.h"
+#include <vector>
+#include <unordered_map>
+
+namespace cube
+{
+
+/// Depth and uncertainty of a grid quantised to 16 bits for sending over
+/// low bandwidth links.
+///
+/// Each layer is quantised as q = 1 + round((value - offset)/scale), with
+/// q = 0 reserved for NaN.  A delta tile holds the difference, modulo
+/// 2^16, from the quantised values of the tile version named by
+/// base_version, and uses that version's offset and scale.  Both layers
+/// are then run length encoded: a zero word is followed by a word with
+/// the number of zeros in the run, other words are literal.
+struct CompactTile
+{
+  GridIndex index;
+  CellCounts counts = CellCounts(0);
+
+  /// Incremented each time the grid is encoded
+  uint32_t version = 0;
+
+  /// Version this tile is a delta against, or 0 for a key tile
+  uint32_t base_version = 0;
+
+  float depth_offset = 0.0;
+  float depth_scale = 1.0;
+  float uncertainty_offset = 0.0;
+  float uncertainty_scale = 1.0;
+
+  std::vector<uint16_t> depth;
+  std::vector<uint16_t> uncertainty;
+
+  /// Approximate size on the wire, in bytes
+  std::size_t encodedSize() const;
+};
+
+/// Encodes grids as CompactTiles, remembering what was sent for each grid
+/// so that later versions can be sent as deltas.
+class CompactTileEncoder
+{
+public:
+  /// With delta set, a tile is sent as a delta from the previous version
+  /// whenever its values fit the previous offset and scale, except that
+  /// every key_interval-th version is a key tile so a receiver that
+  /// missed a tile can recover.
+  CompactTileEncoder(bool delta = true, uint32_t key_interval = 10);
+
+  /// Encode values, in row major order from the grid origin, into tile.
+  /// Returns false, and forgets the grid, if all the values are NaN so
+  /// there is nothing to send.
+  bool encode(const GridIndex& index, const CellCounts& counts, const std::vector<DepthAndUncertainty>& values, CompactTile& tile);
+
+private:
+  struct Sent
+  {
+    uint32_t version = 0;
+    CellCounts counts = CellCounts(0);
+    float depth_offset, depth_scale, uncertainty_offset, uncertainty_scale;
+    std::vector<uint16_t> depth;
+    std::vector<uint16_t> uncertainty;
+  };
+
+  bool delta_;
+  uint32_t key_interval_;
+  std::unordered_map<GridIndex, Sent> sent_;
+};
+
+/// Rebuilds grid values from CompactTiles, keeping the last version of
+/// each grid to apply deltas to.
+class CompactTileDecoder
+{
+public:
+  /// Decode tile into values, in row major order from the grid origin.
+  /// Returns false if tile is a delta against a version this decoder
+  /// does not have, or is malformed.
+  bool decode(const CompactTile& tile, std::vector<DepthAndUncertainty>& values);
+
+private:
+  struct Received
+  {
+    uint32_t version = 0;
+    std::vector<uint16_t> depth;
+    std::vector<uint16_t> uncertainty;
+  };
+
+  std::unordered_map<GridIndex, Received> received_;
+};
+
+} // namespace cube
+
+#endif
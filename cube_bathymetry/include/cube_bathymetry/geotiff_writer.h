@@ -0,0 +1,49 @@
+#ifndef CUBE_BATHYMETRY_GEOTIFF_WRITER_H
+#define CUBE_BATHYMETRY_GEOTIFF_WRITER_H
+
+#include "map_sheet.h"
+#include <string>
+
+namespace cube
+{
+
+/// Options for writeGeoTiff
+struct GeoTiffOptions
+{
+  /// Write a cloud optimised GeoTIFF: compressed, with internal
+  /// overviews stored ahead of the full resolution tiles, so viewers
+  /// only read the resolution they display.
+  bool cloud_optimised = false;
+
+  /// GTiff COMPRESS option used for cloud optimised output
+  std::string compression = "DEFLATE";
+
+  /// Add hypothesis_count, hypothesis_strength_ratio and sample_count
+  /// bands after depth and uncertainty.  They come from the same pass
+  /// over the nodes, see NodeValues.
+  bool extra_layers = false;
+};
+
+/// Write the surface of sheet to a tiled GeoTIFF with a depth band and an
+/// uncertainty band, plus optional extra layers.  Each grid is one tile, extracted and written in
+/// turn so the whole surface is never held in memory.  Cells without
+/// data, including those of missing grids, are NaN.  Pixels are centred
+/// on the nodes, with the first row at the north edge.
+///
+/// TIFF tiles must be a multiple of 16 pixels, so the grid cell counts
+/// must be too, otherwise std::invalid_argument is thrown.  projection is
+/// the WKT, EPSG code or proj string of the map frame of the sheet, and
+/// is converted to WKT for GDAL.  Throws std::runtime_error if it can't
+/// be converted or GDAL fails.
+///
+/// For cloud optimised output, the tiles and overviews are first written
+/// uncompressed to filename with ".tmp" appended, then copied to filename.
+/// The ".tmp" file is deleted afterwards, or if writing fails.
+/// Each overview halves the resolution of the previous one, down to a
+/// single tile.  An overview pixel is the mean of the non-NaN pixels it
+/// covers, so holidays only show where there is no data at all.
+void writeGeoTiff(const MapSheet& sheet, const std::string& filename, const std::string& projection, const GeoTiffOptions& options = GeoTiffOptions());
+
+} // namespace cube
+
+#endif
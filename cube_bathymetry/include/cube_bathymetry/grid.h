@@ -7,6 +7,7 @@
 #include "bounds.h"
 
 #include <memory>
+#include <chrono>
 
 
 namespace cube
@@ -50,15 +51,38 @@ public:
   */
   bool insert(const Sounding &sounding);
   bool insert(const std::vector<Sounding> & soundings);
+  bool insert(const Sounding* begin, const Sounding* end);
 
   const MapPosition &origin() const;
   const CellCounts &cellCounts() const;
   const CellSizes &cellSizes() const;
   
   MapBounds bounds() const;
+
+  /// Node at index, or nullptr if the index is outside the grid or the
+  /// node has received no data
+  std::shared_ptr<Node> node(const CellIndex& index) const;
+
+  /// Sheet update count at which soundings were last inserted in this grid
+  uint64_t lastUpdate() const;
+
+  /// Time of the newest soundings inserted in this grid
+  std::chrono::steady_clock::time_point lastUpdateTime() const;
+
+  /// Record an update that inserted soundings stamped with time
+  void setLastUpdate(uint64_t update, std::chrono::steady_clock::time_point time);
   
   std::vector<DepthAndUncertainty> values() const;
 
+  /// Like values, but with all the exported layers of each node from a
+  /// single pass over the nodes.  Cells without a node hold the default
+  /// NodeValues.
+  std::vector<NodeValues> nodeValues() const;
+
+  /// Add the number of hypotheses at each populated node to histogram,
+  /// where histogram[n] counts the nodes tracking n hypotheses.
+  void hypothesisCountHistogram(std::vector<uint64_t> &histogram) const;
+
 private:
   CellCounts counts_;
   CellSizes sizes_;
@@ -69,6 +93,9 @@ private:
 
   std::vector<std::shared_ptr<Node> > nodes_;
 
+  uint64_t last_update_ = 0;
+  std::chrono::steady_clock::time_point last_update_time_;
+
 };
 
 } // namespace cube
@@ -0,0 +1,69 @@
+#ifndef CUBE_BATHYMETRY_GSF_READER_H
+#define CUBE_BATHYMETRY_GSF_READER_H
+
+#include "local_projection.h"
+#include "sounding.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cube
+{
+
+struct GsfReaderOptions
+{
+  /// Standard deviations (m) used for beams when the file has no error
+  /// arrays.  The arrays are read as 95% confidence limits.
+  float vertical_error = 0.25;
+  float horizontal_error = 1.0;
+
+  /// Pings decoded ahead of the consumer
+  std::size_t read_ahead = 16;
+};
+
+/// Reads the swath bathymetry pings of a GSF file with libgsf, like
+/// sounding_gsf.c in the original library.  Pings are decoded on a
+/// separate thread, so decoding overlaps whatever the caller does with
+/// the previous pings, such as adding them to a MapSheet.
+///
+/// Beams are positioned from the transducer position, heading and along
+/// and across track offsets, and projected with projection.  Null depths,
+/// beams flagged to be ignored and pings flagged to be ignored are
+/// skipped.
+///
+/// libgsf reports errors through a global, so only one GsfReader should
+/// be open at a time.
+class GsfReader
+{
+public:
+  /// Open filename, throwing std::runtime_error if it can't be opened
+  GsfReader(const std::string& filename, const LocalProjection& projection, const GsfReaderOptions& options = GsfReaderOptions());
+  ~GsfReader();
+
+  GsfReader(const GsfReader&) = delete;
+  GsfReader& operator=(const GsfReader&) = delete;
+
+  /// Swap the soundings of the next ping with at least one sounding into
+  /// ping, returning false at the end of the file.  The vector passed in
+  /// is reused for a later ping, so once every buffer has grown to the
+  /// largest ping, reading allocates nothing.  Throws std::runtime_error
+  /// if the file can't be read.
+  bool next(std::vector<Sounding>& ping);
+
+  /// Number of ping records read so far, including those that had no
+  /// soundings.  Pings are read ahead of next(), so the count is only
+  /// final once next() has returned false.
+  uint64_t pingCount() const;
+
+  /// Position (degrees) of the first ping in filename, for the origin of
+  /// a LocalProjection.  Returns false if there are no pings.
+  static bool firstPosition(const std::string& filename, double& latitude, double& longitude);
+
+private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+} // namespace cube
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <memory>
+#include "cube_bathymetry/config.h"
 #include "parameters.h"
 
 namespace cube
@@ -14,11 +15,14 @@ namespace cube
 /// of elements incorporated in the node is also recorded so that a pseudo-MAP
 /// estimate of best model (or at least most frequently visited model) can be
 /// computed.
-struct Hypothesis
+/// StorageT is the type used to hold the estimates and monitoring state
+/// between updates.  The update arithmetic is always done in double.
+template <typename StorageT>
+struct BasicHypothesis
 {
-  Hypothesis(float initial_mean, float initial_variance);
+  BasicHypothesis(float initial_mean, float initial_variance);
 
-  static std::shared_ptr<Hypothesis> generateNullHypothesis(float depth, float variance);
+  static std::shared_ptr<BasicHypothesis> generateNullHypothesis(float depth, float variance);
 
   /// Reset monitoring structure to defaults
   void resetMonitor();
@@ -44,6 +48,13 @@ struct Hypothesis
   ///    true if an intervention is indicated, otherwise false
   bool monitor(float depth, float variance, const Parameters& parameters);
 
+  /// Log-domain form of monitor().  The cumulative Bayes factor is kept as
+  /// its logarithm and compared against the thresholds precomputed in
+  /// Parameters, so no transcendental is evaluated per update.  Returns
+  /// the same decisions as monitor().  A hypothesis must be monitored in
+  /// one domain only.
+  bool monitorLogDomain(float depth, float variance, const Parameters& parameters);
+
   /// Update a particular hypothesis being tracked at a node
   /// This implements the standard univariate dynamic linear model update
   /// equations (West & Harrison, 'Bayesian Forecasting and Dynamic
@@ -66,19 +77,21 @@ struct Hypothesis
   bool update(float depth, float variance, const Parameters& parameters);
 
   /// Current depth mean estimate
-  double current_estimate;
+  StorageT current_estimate;
 
   /// Current depth variance estimate
-  double current_variance;
+  StorageT current_variance;
 
   /// Current depth next-state mean prediction
-  double predicted_estimate;
+  StorageT predicted_estimate;
 
   /// Current depth next-state variance pred.
-  double predicted_variance;
+  StorageT predicted_variance;
 
-  /// Cumulative Bayes factor for node monitoring
-  double cumulative_bayes_factor = 1.0;
+  /// Cumulative Bayes factor for node monitoring, or its log when
+  /// monitorLogDomain() is used.  The reset value of 1 starts a new run
+  /// in either form.
+  StorageT cumulative_bayes_factor = 1.0;
 
   /// Worst-case sequence length for monitoring
   uint16_t sequence_length = 0;
@@ -105,6 +118,18 @@ struct Hypothesis
   float maximum_of_input_and_predicted_variance = 0.0;
 };
 
+/// Persistent hypothesis state is kept in double precision unless the
+/// library is configured with CUBE_FLOAT_HYPOTHESIS_STORAGE, which halves
+/// the memory used by the estimates at some cost in accuracy.  The choice
+/// is recorded in config.h.
+#ifdef CUBE_FLOAT_HYPOTHESIS_STORAGE
+using HypothesisStorage = float;
+#else
+using HypothesisStorage = double;
+#endif
+
+using Hypothesis = BasicHypothesis<HypothesisStorage>;
+
 } // namespace cube
 
 #endif
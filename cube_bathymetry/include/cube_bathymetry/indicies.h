@@ -3,6 +3,7 @@
 
 #include "xy.h"
 #include "sizes.h"
+#include <functional>
 
 namespace cube
 {
@@ -46,4 +47,19 @@ struct GridIndex: public XYIndex<int32_t, GridIndex, GridCounts>
 
 } // namespace cube
 
+namespace std
+{
+
+/// Hash so GridIndex can key an unordered_map
+template <>
+struct hash<cube::GridIndex>
+{
+  std::size_t operator()(const cube::GridIndex& index) const noexcept
+  {
+    return std::hash<uint64_t>()(uint64_t(uint32_t(index.x)) << 32 | uint32_t(index.y));
+  }
+};
+
+} // namespace std
+
 #endif
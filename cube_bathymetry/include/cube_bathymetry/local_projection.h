@@ -0,0 +1,36 @@
+#ifndef CUBE_BATHYMETRY_LOCAL_PROJECTION_H
+#define CUBE_BATHYMETRY_LOCAL_PROJECTION_H
+
+#include "common.h"
+#include <string>
+
+namespace cube
+{
+
+/// Equirectangular projection centred on an origin, for putting soundings
+/// read with geographic positions on a sheet.  It is the same as the proj
+/// string returned by projString(), so rasters of the sheet can be
+/// georeferenced.  East-west distances stretch by about tan(latitude)
+/// times the north-south distance from the origin (0.16% at 10 km and
+/// 45 degrees), so it suits survey-sized sheets.
+class LocalProjection
+{
+public:
+  /// Origin in degrees
+  LocalProjection(double latitude, double longitude);
+
+  /// Map position, east and north of the origin in meters, of a
+  /// position in degrees
+  MapPosition project(double latitude, double longitude) const;
+
+  std::string projString() const;
+
+private:
+  double latitude_;
+  double longitude_;
+  double cos_latitude_;
+};
+
+} // namespace cube
+
+#endif
@@ -3,11 +3,33 @@
 
 #include "grid.h"
 #include <map>
+#include <unordered_map>
 #include <chrono>
 
 namespace cube
 {
 
+/// Estimate and hypotheses at a single node, as returned by
+/// mapsheet_get_hypo_by_location in the original library
+struct NodeQuery
+{
+  /// Position of the node in map coordinates
+  MapPosition position;
+
+  /// Current best estimate, as extracted for the published surface
+  DepthAndUncertainty estimate;
+
+  /// Hypotheses that have incorporated samples
+  std::vector<HypothesisSummary> hypotheses;
+
+  /// Position in hypotheses of the nominated hypothesis, or -1 for none
+  int32_t nominated = -1;
+
+  /// Estimates still waiting in the median pre-filter queue, which are
+  /// not yet reflected in the hypotheses
+  uint32_t queued = 0;
+};
+
 /// A grid of Grids used to grow surfaces without knowing the bounds
 /// ahead of time.
 class MapSheet
@@ -17,25 +39,69 @@ public:
   /// individual cells and order is the IHO order.
   MapSheet(CellCounts counts, CellSizes sizes, std::string iho_order = "order1a");
 
+  /// Constructor taking fully configured algorithm parameters.  The
+  /// parameters should have been created for the same cell sizes.
+  MapSheet(CellCounts counts, CellSizes sizes, const Parameters& parameters);
+
+  /// Pick square grid cell counts so that a fully populated grid uses
+  /// about tile_bytes of memory.  The counts are a multiple of 16, so
+  /// grids map onto whole GeoTIFF blocks, and a grid is at least as wide
+  /// as the maximum context search range, which parameters derives from
+  /// the resolution.
+  static CellCounts autoCellCounts(std::size_t tile_bytes, const Parameters& parameters);
+
   void addSoundings(const std::vector<Sounding> & soundings, std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now());
 
+  /// Add the soundings in [begin, end), which can point straight into a
+  /// memory mapped file so nothing is copied
+  void addSoundings(const Sounding* begin, const Sounding* end, std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now());
+
   /// Return the grids within the bounds, creating new ones if necessary
   std::vector<std::shared_ptr<Grid> > getOrCreateGridsIn(const MapBounds& bounds);
 
   /// Return all existing grids
   std::vector<std::shared_ptr<Grid> > grids() const;
 
+  /// Number of addSoundings calls that inserted data so far.  Pass a
+  /// previously returned value to gridsUpdatedSince to find the grids
+  /// that have changed since.
+  uint64_t updateCount() const;
+
+  /// Return the grids that received soundings after the given update count
+  std::map<GridIndex, std::shared_ptr<Grid> > gridsUpdatedSince(uint64_t update) const;
+
+  /// Fill result for the node closest to position.  Returns false if
+  /// that node has received no data.  Finding the node is a hash lookup
+  /// of its grid, so the cost does not depend on the size of the sheet.
+  /// Nothing is flushed, so soundings still in the node's queue are
+  /// only counted.
+  bool queryNode(const MapPosition& position, NodeQuery& result) const;
+
+  /// Append the nodes within bounds that have received data to results,
+  /// stopping after maximum_nodes.  Returns false if the limit was hit.
+  /// Only the grids overlapping bounds are visited.
+  bool queryNodes(const MapBounds& bounds, std::size_t maximum_nodes, std::vector<NodeQuery>& results) const;
+
   /// Return total cell count of rectangle containing all the grids
   CellCounts totalCellCounts() const;
 
   /// Return bounds in map coordinates of rectangle containing all the grids
   MapBounds gridBounds() const;
 
+  /// Histogram of hypotheses per populated node over all grids, where
+  /// element n is the number of nodes tracking n hypotheses.
+  std::vector<uint64_t> hypothesisCountHistogram() const;
+
+  /// Algorithm parameters shared by all the grids
+  Parameters& parameters();
+  const Parameters& parameters() const;
+
   const CellSizes& cellSizes() const;
   const CellCounts& cellCountsPerGrid() const;
 
   GridIndex gridIndex(const MapPosition &position) const;
 
+  /// Time of the newest soundings inserted in the sheet
   std::chrono::steady_clock::time_point lastUpdateTime() const;
 
 private:
@@ -46,9 +112,17 @@ private:
 
   Parameters parameters_;
 
-  std::map<GridIndex, std::shared_ptr<Grid> > grids_;
+  std::unordered_map<GridIndex, std::shared_ptr<Grid> > grids_;
+
+  /// Fill result from the node at the given sheet-wide node index
+  bool queryNode(int64_t column, int64_t row, NodeQuery& result) const;
+
+  /// Fill result from the node at cell_index in grid
+  bool queryNode(const Grid& grid, const CellIndex& cell_index, NodeQuery& result) const;
 
   std::chrono::steady_clock::time_point last_update_time_;
+
+  uint64_t update_count_ = 0;
 };
 
 } // namespace cube
@@ -7,11 +7,50 @@
 #include "common.h"
 #include "parameters.h"
 #include "sounding.h"
-#include <list>
 
 namespace cube
 {
 
+/// A depth hypothesis as reported to users, like the Hypo structure of
+/// the original library
+struct HypothesisSummary
+{
+  /// Current depth estimate (m)
+  float depth;
+
+  /// Confidence interval of the estimate (m), scaled from the standard
+  /// deviation by stddev_to_confidence_interval_scale
+  float confidence_interval;
+
+  /// Number of samples incorporated in the hypothesis
+  uint32_t sample_count;
+};
+
+/// Everything exported for a node, so that all the layers can be
+/// extracted in a single visit
+struct NodeValues
+{
+  float depth = std::numeric_limits<float>::quiet_NaN();
+  float uncertainty = std::numeric_limits<float>::quiet_NaN();
+
+  /// Hypothesis strength ratio, as cube_node_extract_depth_unct reports
+  /// it: 5 less the ratio of the samples in the best hypothesis to those
+  /// in the next best, clipped at 0.  It is 0 with a single hypothesis or
+  /// a nomination, higher values mean less certainty about the choice,
+  /// and NaN where there is no depth.
+  float ratio = std::numeric_limits<float>::quiet_NaN();
+
+  /// Number of depth hypotheses being tracked
+  uint32_t hypothesis_count = 0;
+
+  /// Samples incorporated in the hypotheses, plus those still waiting in
+  /// the median pre-filter queue
+  uint32_t sample_count = 0;
+};
+
+/// Most nodes only ever track a single hypothesis, so a node holds its
+/// first hypothesis inline and only moves to the general list form on
+/// its first intervention.
 class Node
 {
 public:
@@ -23,6 +62,24 @@ public:
   /// return true if the hypothesis was added, otherwise false
   bool addHypothesis(float depth, float variance);
 
+  /// Make room for a new hypothesis if the node is at the
+  /// parameters.maximum_hypotheses limit.  The hypothesis with the fewest
+  /// samples (the newest on ties) is merged into the closest remaining
+  /// hypothesis when their normalised separation is below
+  /// parameters.estimateOffset(), and is discarded otherwise.
+  void limitHypotheses(const Parameters& parameters);
+
+  /// Number of depth hypotheses currently being tracked
+  std::size_t hypothesisCount() const;
+
+  /// Append the hypotheses that have incorporated samples to summaries,
+  /// as cube_node_enumerate_hypotheses does.  Returns the position in
+  /// summaries of the nominated hypothesis, or -1 if none is nominated.
+  int32_t enumerateHypotheses(const Parameters& parameters, std::vector<HypothesisSummary>& summaries) const;
+
+  /// Number of estimates waiting in the median pre-filter queue
+  std::size_t queuedCount() const;
+
   /// Update the CUBE equations for this node and input
   /// This runs the basic filter equations, using the KF formulation, and
   /// its innovations formulation.  Note that the updates have to be done
@@ -45,21 +102,22 @@ public:
   ///     evolution noise (a.k.a. system noise variance).
   bool update(float depth, float variance, const Parameters& parameters);
 
-  /// Find the closest matching hypothesis in the current linked list.
+  /// Find the closest matching hypothesis in the current list.
   /// This computes the normalised absolute error between one-step
   /// forecast for each hypothesis currently being tracked and the input
   /// sample; a pointer to the node with smallest error is returned, or
   /// NULL if there are no nodes.  If there is more than one node with
-  /// the same error (unlikely in practice, but possible), then the last
-  /// one in the list is chosen.  Since the list is maintained in
-  /// push-down order this is the first hypothesis proposed (typically
-  /// the `right' one unless the system burst fails at the start of
-  /// sequence).
+  /// the same error (unlikely in practice, but possible), then the
+  /// first hypothesis proposed is chosen (typically the `right' one
+  /// unless the system burst fails at the start of sequence).
+  /// The hypotheses are held contiguously and compared on squared
+  /// normalised error, so the search needs no sqrt.
   ///   depth: Current input sample to be matched
   ///   variance: Current input variance to be matched
-  /// Returns shared pointer to closest matching hypothesis of depth in the list
-  /// provided, or NULL if there is no match (i.e., NULL root)
-  std::shared_ptr<Hypothesis> bestHypothesis(float depth, float variance);
+  /// Returns pointer to closest matching hypothesis of depth in the list,
+  /// or NULL if there is no match (i.e., no hypotheses).  The pointer is
+  /// invalidated by adding a hypothesis.
+  Hypothesis* bestHypothesis(float depth, float variance);
 
 
   /// Insert a single depth value into the node
@@ -110,6 +168,11 @@ public:
   */
   DepthAndUncertainty extractDepthAndUncertainty(const Parameters & parameters);
 
+  /// Extract the depth and uncertainty as extractDepthAndUncertainty
+  /// does, along with the other exported values, in one pass over the
+  /// hypotheses.
+  NodeValues extractValues(const Parameters & parameters);
+
   /* Routine:	cube_node_choose_hypothesis
   * Purpose:	Choose the current best hypothesis for the node in question
   * Inputs:	*list	Pointer to the list of hypotheses
@@ -124,7 +187,7 @@ public:
   *			hypothesis list to sort ... expect Very Bad Things (tm) to happen
   *			if this isn't dealt with externally.
   */
-  std::shared_ptr<Hypothesis> chooseHypothesis();
+  Hypothesis* chooseHypothesis();
 
   /* Routine:	cube_node_truncate
  * Purpose:	Truncate a buffered sequence to reject outliers
@@ -162,14 +225,27 @@ public:
   void queueFlush(const Parameters & parameters);
 
 private:
-  /// Queued points in pre-filter
-  std::list<DepthAndUncertainty> queue_;
+  /// Move the inline hypothesis, if any, to the general list form
+  void generaliseHypotheses();
+
+  /// Start of the hypotheses being tracked, inline or general
+  Hypothesis* hypotheses();
+  const Hypothesis* hypotheses() const;
+
+  /// Queued points in pre-filter, sorted deepest first
+  std::vector<DepthAndUncertainty> queue_;
+
+  /// The only depth hypothesis, while inline_hypothesis_valid_ is set
+  Hypothesis inline_hypothesis_ = Hypothesis(0.0, 0.0);
+
+  /// Depth hypotheses being tracked after the first intervention
+  std::vector<Hypothesis> depth_hypotheses_;
 
-  /// Depth hypotheses currently being tracked
-  std::vector<std::shared_ptr<Hypothesis> > depth_hypotheses_;
+  /// Index of a nominated hypothesis from the user, or -1 for none
+  int32_t nominated_hypothesis_ = -1;
 
-  /// A nominated hypothesis from the user
-  std::shared_ptr<Hypothesis> nominated_hypothesis_;
+  /// True while the node tracks a single hypothesis held inline
+  bool inline_hypothesis_valid_ = false;
 
   /// Predicted depth, or NaN for 'no update', or
   /// INVALID_DATA for 'no information available'
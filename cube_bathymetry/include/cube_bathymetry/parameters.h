@@ -5,6 +5,7 @@
 #include <limits>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace cube
 {
@@ -48,6 +49,38 @@ struct Parameters
   void setIHOLimits(std::string order);
   void setGridResolution(CellSizes sizes);
 
+  /// Set the intervention thresholds used by the Bayes factor monitor and
+  /// precompute their log-domain forms.
+  void setMonitoringThresholds(float estimate_offset, float bayes_factor_threshold);
+
+  /// Threshold for significant offset from current
+  /// estimate to warrant an intervention
+  float estimateOffset() const {return estimate_offset_;}
+
+  /// Bayes factor threshold for either a single
+  /// estimate, or the worst-case recent sequence to
+  /// warrant an intervention
+  float bayesFactorThreshold() const {return bayes_factor_threshold_;}
+
+  /// 0.5*estimateOffset()^2, the constant term of the log Bayes factor
+  double logBayesFactorOffset() const {return log_bayes_factor_offset_;}
+
+  /// log(bayesFactorThreshold())
+  double logBayesFactorThreshold() const {return log_bayes_factor_threshold_;}
+
+  /// Set the field called name from its text representation, recomputing
+  /// any values derived from it.  Throws std::invalid_argument for an
+  /// unknown name or a value that can't be parsed or is out of range.
+  void set(const std::string& name, const std::string& value);
+
+  /// Check the constraints between fields, which set() can't do since it
+  /// depends on the order they are set in.  Throws std::invalid_argument
+  /// if they are violated.  Call it after the last set().
+  void validate() const;
+
+  /// Names accepted by set()
+  static const std::vector<std::string>& names();
+
   /// Value used to indicate 'no data' (typ. FLT_MAX)
   float no_data_value = std::numeric_limits<float>::quiet_NaN();
 
@@ -91,20 +124,24 @@ struct Parameters
   /// Discount factor for evolution noise variance
   float discount = 1.0;
 
-  /// Threshold for significant offset from current
-  /// estimate to warrant an intervention
-  float estimate_offset = 4.0;
-
-  /// Bayes factor threshold for either a single
-  /// estimate, or the worst-case recent sequence to
-  /// warrant an intervention
-  float bayes_factor_threshold = 0.135;
-
   /// Run-length threshold for worst-case recent
   /// sequence to indicate a drift failure and hence
   /// to warrant an intervention
   uint32_t runlength_threshold = 5;
 
+  /// Run the Bayes factor monitor in the log domain, comparing against
+  /// the precomputed log thresholds rather than calling exp() on every
+  /// update.  Intervention decisions are the same either way.  Set it
+  /// before adding soundings, since hypotheses keep their cumulative
+  /// Bayes factor in the form the monitor uses.
+  bool log_domain_monitoring = false;
+
+  /// Maximum number of hypotheses tracked at a node, or 0 for no limit.
+  /// When a new hypothesis is needed at a full node, the one with the
+  /// fewest samples is merged into its closest neighbour if they are
+  /// within estimateOffset() of each other, otherwise it is dropped.
+  uint32_t maximum_hypotheses = 0;
+
   /// Minimum context search range for hypothesis
   /// disambiguation algorithm
   float minimum_context_search_range = 5.0;
@@ -133,6 +170,15 @@ struct Parameters
   /// hydrography but can be greater for geological mapping
   /// in flat areas with sparse data)
   float capture_distance_scale = 0.05;
+
+private:
+  /* Only set through setMonitoringThresholds() so the log-domain forms
+   * can't go stale.
+   */
+  float estimate_offset_ = 4.0;
+  float bayes_factor_threshold_ = 0.135;
+  double log_bayes_factor_offset_ = 0.0;
+  double log_bayes_factor_threshold_ = 0.0;
 };
 
 } // namespace cube
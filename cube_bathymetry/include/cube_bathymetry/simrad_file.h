@@ -0,0 +1,89 @@
+#ifndef CUBE_BATHYMETRY_SIMRAD_FILE_H
+#define CUBE_BATHYMETRY_SIMRAD_FILE_H
+
+#include "local_projection.h"
+#include "sounding.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cube
+{
+
+struct SimradReaderOptions
+{
+  /// Standard deviations (m) given to every beam, since the original
+  /// library's error model is not ported
+  float vertical_error = 0.25;
+  float horizontal_error = 1.0;
+};
+
+/// A Kongsberg (Simrad) EM series raw file mapped into memory, read like
+/// read_simrad.c in the original library.
+///
+/// Opening the file scans it once, recording where each depth datagram
+/// (0x44) starts and decoding the position datagrams (0x50) of the
+/// active positioning system into a navigation table.  Pings are then
+/// decoded straight from the mapping.  Datagrams may be big or little
+/// endian, which is detected from the first datagram.  Corrupt stretches
+/// of up to 1024 bytes are skipped, as in the original reader, and the
+/// first datagram after one must have a valid checksum.
+class SimradFile
+{
+public:
+  /// Map and index filename, throwing std::runtime_error if it can't be
+  /// mapped or isn't an EM series raw file
+  explicit SimradFile(const std::string& filename);
+  ~SimradFile();
+
+  SimradFile(const SimradFile&) = delete;
+  SimradFile& operator=(const SimradFile&) = delete;
+
+  /// Number of depth datagrams
+  std::size_t pingCount() const;
+
+  /// Number of bytes skipped resynchronising while indexing
+  std::size_t skippedBytes() const;
+
+  /// Append the beams of depth datagram ping to soundings.  Beams are
+  /// positioned from the navigation interpolated to the ping time, the
+  /// heading in the datagram and the along and across track offsets of
+  /// each beam.  Returns false, adding nothing, if the ping is outside
+  /// the navigation.
+  bool decodePing(std::size_t ping, const LocalProjection& projection, const SimradReaderOptions& options, std::vector<Sounding>& soundings) const;
+
+  /// Position (degrees) of the first position datagram from the active
+  /// positioning system in filename, for the origin of a
+  /// LocalProjection.  Returns false if there is none.
+  static bool firstPosition(const std::string& filename, double& latitude, double& longitude);
+
+private:
+  struct Fix
+  {
+    double time;
+    double latitude;
+    double longitude;
+  };
+
+  const uint8_t* bytes() const;
+
+  void* mapping_ = nullptr;
+  std::size_t mapping_size_ = 0;
+  bool big_endian_ = true;
+  std::size_t skipped_bytes_ = 0;
+  std::vector<std::size_t> depth_offsets_;
+  std::vector<Fix> fixes_;
+};
+
+/// Read several EM series raw files at once, each indexed and decoded on
+/// its own thread, up to threads files at a time.  Soundings are passed
+/// to consume in batches of at least batch_size, except at the end of
+/// each file, and in file order, so the result does not depend on the
+/// number of threads.  The batch buffers are reused, so consume must not
+/// keep the pointers.  Returns the number of pings read.  Throws
+/// std::runtime_error if a file can't be read.
+uint64_t readSimradFiles(const std::vector<std::string>& filenames, const LocalProjection& projection, const SimradReaderOptions& options, std::size_t threads, std::size_t batch_size, const std::function<void(const Sounding*, const Sounding*)>& consume);
+
+} // namespace cube
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef CUBE_BATHYMETRY_SOUNDING_FILE_H
+#define CUBE_BATHYMETRY_SOUNDING_FILE_H
+
+#include "sounding.h"
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cube
+{
+
+/// Soundings files for driving a MapSheet without ROS.
+///
+/// The binary format is a 16 byte header, the magic "CUBESND\0" followed
+/// by the little endian uint32 version (1) and record size (32), then
+/// one record per sounding laid out exactly as a Sounding on little
+/// endian machines: float64 x and y (m), float32 depth (m, positive
+/// down), float32 vertical and horizontal error variances (m^2), and 4
+/// bytes of padding.
+///
+/// The ASCII format has one sounding per line, with the same five fields
+/// separated by whitespace.  Blank lines and lines starting with # are
+/// skipped.
+
+/// A binary soundings file mapped into memory.  The soundings are used
+/// where they lie in the mapping, without copying or parsing.
+class MappedSoundingFile
+{
+public:
+  /// Map filename, throwing std::runtime_error if it can't be mapped or
+  /// isn't a binary soundings file
+  explicit MappedSoundingFile(const std::string& filename);
+  ~MappedSoundingFile();
+
+  MappedSoundingFile(const MappedSoundingFile&) = delete;
+  MappedSoundingFile& operator=(const MappedSoundingFile&) = delete;
+
+  const Sounding* begin() const;
+  const Sounding* end() const;
+  std::size_t size() const;
+
+  /// True if filename starts with the binary soundings file magic
+  static bool isBinary(const std::string& filename);
+
+private:
+  void* mapping_ = nullptr;
+  std::size_t mapping_size_ = 0;
+  const Sounding* begin_ = nullptr;
+  const Sounding* end_ = nullptr;
+};
+
+/// Read an ASCII soundings file, passing the soundings to consume in
+/// batches of up to batch_size.  The batch buffer is reused, so consume
+/// must not keep the pointers.  Throws std::runtime_error if the file
+/// can't be read or a line can't be parsed.
+void readAsciiSoundings(const std::string& filename, std::size_t batch_size, const std::function<void(const Sounding*, const Sounding*)>& consume);
+
+/// Writes a binary soundings file a batch at a time, so the soundings
+/// don't have to be held in memory until the end
+class SoundingFileWriter
+{
+public:
+  /// Create filename and write the header.  Throws std::runtime_error if
+  /// it can't be created.
+  explicit SoundingFileWriter(const std::string& filename);
+
+  /// Append soundings, throwing std::runtime_error if they can't be written
+  void write(const Sounding* begin, const Sounding* end);
+
+  /// Flush and close the file, throwing std::runtime_error if anything
+  /// failed to be written.  The destructor closes it without checking.
+  void close();
+
+private:
+  std::string filename_;
+  std::ofstream out_;
+  std::vector<char> records_;
+};
+
+/// Write soundings to filename in the binary format
+void writeSoundingFile(const std::string& filename, const std::vector<Sounding>& soundings);
+
+} // namespace cube
+
+#endif
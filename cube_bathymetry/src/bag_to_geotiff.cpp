@@ -8,18 +8,344 @@
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <sensor_msgs/NavSatFix.h>
 #include <cube_bathymetry/map_sheet.h>
+#include <cube_bathymetry/geotiff_writer.h>
+#include <cube_bathymetry/bag_writer.h>
+#include "ogr_spatialref.h"
+#include "cpl_conv.h"
 #include <geometry_msgs/PointStamped.h>
 
-#include "gdal_priv.h"
 //#include <errno.h>
+#include <queue>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <ros/serialization.h>
+#include <std_msgs/Header.h>
+#include <boost/make_shared.hpp>
+
+/// A sounding cloud waiting for its transform, with the navigation fix
+/// that was current when it was read
+struct PendingCloud
+{
+  sensor_msgs::PointCloud2::ConstPtr cloud;
+  sensor_msgs::NavSatFix nav;
+
+  /// Order so the oldest stamp is at the top of a priority_queue
+  bool operator<(const PendingCloud& other) const
+  {
+    return cloud->header.stamp > other.cloud->header.stamp;
+  }
+};
+
+/// Releases sounding clouds in stamp order once the TF buffer covers
+/// them.  Only the oldest cloud is ever checked, with canTransform, so
+/// nothing is rescanned and no exceptions are thrown while waiting for
+/// TF.  A cloud whose chain to the target frame is all static is
+/// released as soon as it is read.
+class CloudScheduler
+{
+public:
+  /// Clouds that still can't be transformed once the transforms read are
+  /// maximum_wait newer than them are dropped.
+  CloudScheduler(const tf2_ros::Buffer& buffer, const std::string& target_frame, ros::Duration maximum_wait)
+    :buffer_(buffer), target_frame_(target_frame), maximum_wait_(maximum_wait)
+  {
+  }
+
+  void add(const sensor_msgs::PointCloud2::ConstPtr& cloud, const sensor_msgs::NavSatFix& nav)
+  {
+    pending_.push({cloud, nav});
+  }
+
+  /// Note the stamp of a dynamic transform added to the buffer.  A cloud
+  /// that still can't be transformed once these are maximum_wait newer
+  /// than it is dropped.
+  void transformAdded(const ros::Time& stamp)
+  {
+    if(stamp > latest_transform_time_)
+      latest_transform_time_ = stamp;
+  }
+
+  /// Call ready(cloud, transform) for each cloud that can now be
+  /// transformed, oldest first
+  template <typename F> void release(F ready)
+  {
+    while(!pending_.empty())
+    {
+      const auto& oldest = pending_.top();
+      const auto& header = oldest.cloud->header;
+      if(buffer_.canTransform(target_frame_, header.frame_id, header.stamp))
+        ready(oldest, buffer_.lookupTransform(target_frame_, header.frame_id, header.stamp));
+      else if(header.stamp < latest_transform_time_ && latest_transform_time_ - header.stamp > maximum_wait_)
+        ++dropped_;
+      else
+        break;
+      pending_.pop();
+    }
+  }
+
+  /// Release what can be transformed at the end of the input and drop
+  /// the rest
+  template <typename F> void flush(F ready)
+  {
+    for(; !pending_.empty(); pending_.pop())
+    {
+      const auto& header = pending_.top().cloud->header;
+      if(buffer_.canTransform(target_frame_, header.frame_id, header.stamp))
+        ready(pending_.top(), buffer_.lookupTransform(target_frame_, header.frame_id, header.stamp));
+      else
+        ++dropped_;
+    }
+  }
+
+  std::size_t pending() const
+  {
+    return pending_.size();
+  }
+
+  uint64_t dropped() const
+  {
+    return dropped_;
+  }
+
+private:
+  const tf2_ros::Buffer& buffer_;
+  std::string target_frame_;
+  ros::Duration maximum_wait_;
+  ros::Time latest_transform_time_;
+  std::priority_queue<PendingCloud> pending_;
+  uint64_t dropped_ = 0;
+};
+
+/// Convert a cloud to soundings in the map frame, taking the uncertainty
+/// from the navigation fix
+std::vector<cube::Sounding> georeference(const PendingCloud& pending, const geometry_msgs::TransformStamped& transform)
+{
+  sensor_msgs::PointCloud2 soundings_in_map_frame;
+  tf2::doTransform(*pending.cloud, soundings_in_map_frame, transform);
+
+  std::vector<cube::Sounding> soundings;
+
+  sensor_msgs::PointCloud2ConstIterator<float> iter_x_sensor(*pending.cloud, "x");
+  sensor_msgs::PointCloud2ConstIterator<float> iter_y_sensor(*pending.cloud, "y");
+  sensor_msgs::PointCloud2ConstIterator<float> iter_z_sensor(*pending.cloud, "z");
+
+  sensor_msgs::PointCloud2ConstIterator<float> iter_x(soundings_in_map_frame, "x");
+  sensor_msgs::PointCloud2ConstIterator<float> iter_y(soundings_in_map_frame, "y");
+  sensor_msgs::PointCloud2ConstIterator<float> iter_z(soundings_in_map_frame, "z");
+  for (; (iter_x != iter_x.end()) && (iter_y != iter_y.end()) && (iter_z != iter_z.end()) && (iter_x_sensor != iter_x_sensor.end()) && (iter_y_sensor != iter_y_sensor.end()) && (iter_z_sensor != iter_z_sensor.end()); ++iter_x, ++iter_y, ++iter_z, ++iter_x_sensor, ++iter_y_sensor, ++iter_z_sensor)
+  {
+    cube::Sounding s;
+    s.x = *iter_x;
+    s.y = *iter_y;
+    s.depth = -*iter_z;
+    //s.range = std::sqrt(*iter_x_sensor * *iter_x_sensor + *iter_y_sensor * *iter_y_sensor + *iter_z_sensor * *iter_z_sensor);
+    s.vertical_error = pending.nav.position_covariance[8]*10.0;
+    s.horizontal_error = std::max(pending.nav.position_covariance[0], pending.nav.position_covariance[4])*10.0;
+
+    soundings.push_back(s);
+  }
+  return soundings;
+}
+
+/// Stamp of a sounding cloud, read from the header at the start of the
+/// serialised message so the points aren't deserialised.  buffer is
+/// reused between calls.
+ros::Time cloudStamp(const rosbag::MessageInstance& m, std::vector<uint8_t>& buffer)
+{
+  buffer.resize(m.size());
+  ros::serialization::OStream out(buffer.data(), buffer.size());
+  m.write(out);
+  std_msgs::Header header;
+  ros::serialization::IStream in(buffer.data(), buffer.size());
+  ros::serialization::deserialize(in, header);
+  return header.stamp;
+}
+
+/// Deserialises and georeferences sounding clouds on a pool of worker
+/// threads while the caller keeps reading the bag.  All the transforms
+/// must already be in the buffer.  Each cloud is added with its rank in
+/// the order the sheet should see it, and results are handed back in
+/// rank order whatever order the workers finish in.  The number of
+/// clouds being worked on is bounded, but finished results are held
+/// until every earlier rank has been added and finished.
+class ParallelGeoreferencer
+{
+public:
+  ParallelGeoreferencer(const tf2_ros::Buffer& buffer, const std::string& target_frame, unsigned thread_count)
+    :buffer_(buffer), target_frame_(target_frame), maximum_in_flight_(4*thread_count)
+  {
+    for(unsigned i = 0; i < thread_count; i++)
+      threads_.emplace_back(&ParallelGeoreferencer::work, this);
+  }
+
+  ~ParallelGeoreferencer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    job_condition_.notify_all();
+    for(auto& t: threads_)
+      t.join();
+  }
+
+  /// Queue a serialised sensor_msgs/PointCloud2 with its rank, waiting
+  /// while too many clouds are in flight.  Results that are ready are
+  /// passed to consume(soundings) in rank order.  Exceptions from the
+  /// workers are rethrown here.
+  template <typename F> void add(uint64_t rank, std::vector<uint8_t>&& serialized, const sensor_msgs::NavSatFix& nav, F consume)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      result_condition_.wait(lock, [this]{return in_flight_ < maximum_in_flight_;});
+      jobs_.push({rank, std::move(serialized), nav});
+      ++in_flight_;
+    }
+    ++added_;
+    job_condition_.notify_one();
+    while(consumeNext(consume, false))
+      ;
+  }
+
+  /// Wait for and consume all the remaining results.  Every rank from 0
+  /// up to the number of clouds added must have been added.
+  template <typename F> void finish(F consume)
+  {
+    while(next_result_ < added_)
+      consumeNext(consume, true);
+  }
+
+  /// Number of clouds that couldn't be transformed
+  uint64_t dropped() const
+  {
+    return dropped_;
+  }
+
+private:
+  struct Job
+  {
+    uint64_t rank;
+    std::vector<uint8_t> serialized;
+    sensor_msgs::NavSatFix nav;
+  };
+
+  struct Result
+  {
+    bool transformed = false;
+    std::vector<cube::Sounding> soundings;
+    std::exception_ptr error;
+  };
+
+  void work()
+  {
+    while(true)
+    {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_condition_.wait(lock, [this]{return stopping_ || !jobs_.empty();});
+        if(jobs_.empty())
+          return;
+        job = std::move(jobs_.front());
+        jobs_.pop();
+      }
+
+      Result result;
+      try
+      {
+        auto cloud = boost::make_shared<sensor_msgs::PointCloud2>();
+        ros::serialization::IStream stream(job.serialized.data(), job.serialized.size());
+        ros::serialization::deserialize(stream, *cloud);
+        if(buffer_.canTransform(target_frame_, cloud->header.frame_id, cloud->header.stamp))
+        {
+          result.transformed = true;
+          result.soundings = georeference({cloud, job.nav}, buffer_.lookupTransform(target_frame_, cloud->header.frame_id, cloud->header.stamp));
+        }
+      }
+      catch(...)
+      {
+        result.error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        results_[job.rank] = std::move(result);
+        --in_flight_;
+      }
+      result_condition_.notify_all();
+    }
+  }
+
+  /// Consume the result with the next rank, waiting for it if wait is
+  /// set.  Returns false if it wasn't ready.
+  template <typename F> bool consumeNext(F consume, bool wait)
+  {
+    Result result;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if(wait)
+        result_condition_.wait(lock, [this]{return results_.count(next_result_) > 0;});
+      auto r = results_.find(next_result_);
+      if(r == results_.end())
+        return false;
+      result = std::move(r->second);
+      results_.erase(r);
+    }
+    ++next_result_;
+    if(result.error)
+      std::rethrow_exception(result.error);
+    if(result.transformed)
+      consume(result.soundings);
+    else
+      ++dropped_;
+    return true;
+  }
+
+  const tf2_ros::Buffer& buffer_;
+  std::string target_frame_;
+  uint64_t maximum_in_flight_;
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable job_condition_;
+  std::condition_variable result_condition_;
+  std::queue<Job> jobs_;
+  std::map<uint64_t, Result> results_;
+  uint64_t in_flight_ = 0;
+  bool stopping_ = false;
+
+  /// Only used by the calling thread
+  uint64_t added_ = 0;
+  uint64_t next_result_ = 0;
+  uint64_t dropped_ = 0;
+};
 
 void usage()
 { 
   std::cout << "usage: bag_to_geotiff [options and input files]\n";
+  std::cout << "  -b: Write a BAG (Bathymetric Attributed Grid) instead of a GeoTIFF\n";
+  std::cout << "  -c: Write a cloud optimised GeoTIFF, compressed with internal overviews\n";
+  std::cout << "  -g 96: Grid size in cells, rounded up to a multiple of 16, 0 to pick it from the grid memory size\n";
+  std::cout << "  -G 4: Target memory per grid in MiB when choosing the grid size\n";
+  std::cout << "  -H 0: Maximum hypotheses per node, 0 for no limit\n";
+  std::cout << "  -i order1a: IHO order (exclusive, special, order1a, order1b or order2)\n";
+  std::cout << "  -j 0: Load all transforms first, then deserialise and georeference soundings on this many threads (0 for a single pass)\n";
+  std::cout << "  -l: Add hypothesis count, hypothesis strength ratio and sample count bands\n";
   std::cout << "  -m map: Map frame\n";
   std::cout << "  -n /fix: NavSatFix topic, optionally used to assess GPS uncertainty\n";
   std::cout << "  -o output.tiff: Output file name\n";
+  std::cout << "  -p name=value: Set a CUBE parameter, may be repeated\n";
+  std::cout << "  -r 0.1: Resolution in meters\n";
+  std::cout << "  -s EPSG:32619: Spatial reference of the map frame, as WKT, EPSG code or proj string, instead of a topocentric one from the earth frame\n";
   std::cout << "  -t /soundings: Topic containing soundings as sensor_msgs/PointCloud2 messages\n";
+  std::cout << "  -w 5: Seconds of newer transforms to wait for before dropping a soundings message\n";
   exit(-1);
 }
 
@@ -35,6 +361,16 @@ int main(int argc, char *argv[])
   std::string map_frame = "map";
   std::string output_filename;
   std::string nav_topic;
+  double resolution = 0.1;
+  uint32_t grid_size = 96;
+  double grid_memory = 4.0;
+  std::string iho_order = "order1a";
+  std::vector<std::pair<std::string, std::string> > cube_parameters;
+  double tf_wait = 5.0;
+  unsigned worker_threads = 0;
+  cube::GeoTiffOptions geotiff_options;
+  bool write_bag = false;
+  std::string spatial_reference;
 
   for (auto arg = arguments.begin(); arg != arguments.end();arg++) 
   {
@@ -42,6 +378,43 @@ int main(int argc, char *argv[])
     {
       usage();
     }
+    else if (*arg == "-b")
+    {
+      write_bag = true;
+    }
+    else if (*arg == "-c")
+    {
+      geotiff_options.cloud_optimised = true;
+    }
+    else if (*arg == "-g")
+    {
+      arg++;
+      grid_size = std::stoul(*arg);
+    }
+    else if (*arg == "-G")
+    {
+      arg++;
+      grid_memory = std::stod(*arg);
+    }
+    else if (*arg == "-H")
+    {
+      arg++;
+      cube_parameters.push_back(std::make_pair("maximum_hypotheses", *arg));
+    }
+    else if (*arg == "-i")
+    {
+      arg++;
+      iho_order = *arg;
+    }
+    else if (*arg == "-j")
+    {
+      arg++;
+      worker_threads = std::stoul(*arg);
+    }
+    else if (*arg == "-l")
+    {
+      geotiff_options.extra_layers = true;
+    }
     else if (*arg == "-m")
     {
       arg++;
@@ -57,17 +430,68 @@ int main(int argc, char *argv[])
       arg++;
       output_filename = *arg;
     }
+    else if (*arg == "-p")
+    {
+      arg++;
+      auto separator = arg->find('=');
+      if(separator == std::string::npos)
+        usage();
+      cube_parameters.push_back(std::make_pair(arg->substr(0, separator), arg->substr(separator+1)));
+    }
+    else if (*arg == "-r")
+    {
+      arg++;
+      resolution = std::stod(*arg);
+    }
+    else if (*arg == "-s")
+    {
+      arg++;
+      spatial_reference = *arg;
+    }
     else if (*arg == "-t")
     {
       arg++;
       bathymetry_topic = *arg;
     }
+    else if (*arg == "-w")
+    {
+      arg++;
+      tf_wait = std::stod(*arg);
+    }
     else
     {
       bagfile_names.push_back(*arg);
     }
   }
 
+  cube::CellSizes cell_sizes(resolution);
+  cube::Parameters parameters(cell_sizes);
+  try
+  {
+    parameters = cube::Parameters(cell_sizes, iho_order);
+    for(const auto& p: cube_parameters)
+      parameters.set(p.first, p.second);
+    parameters.validate();
+  }
+  catch(const std::invalid_argument& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  // Only read the connections we use, so heavy topics such as images are
+  // skipped by rosbag rather than iterated over.
+  auto transform_connection = [](const rosbag::ConnectionInfo* c)
+  {
+    return (c->topic == "/tf" || c->topic == "/tf_static") && c->datatype == "tf2_msgs/TFMessage";
+  };
+  auto data_connection = [&](const rosbag::ConnectionInfo* c)
+  {
+    if(!nav_topic.empty() && c->topic == nav_topic && c->datatype == "sensor_msgs/NavSatFix")
+      return true;
+    return c->datatype == "sensor_msgs/PointCloud2" && (bathymetry_topic.empty() || c->topic == bathymetry_topic);
+  };
+
   rosbag::View view(true);
 
   // keep bags around since call to view takes a pointer to bags
@@ -75,7 +499,10 @@ int main(int argc, char *argv[])
   for(auto bag: bagfile_names)
   {
     bags.push_back(std::make_shared<rosbag::Bag>(bag));
-    view.addQuery(*bags.back());
+    view.addQuery(*bags.back(), [&](const rosbag::ConnectionInfo* c)
+      {
+        return transform_connection(c) || data_connection(c);
+      });
   }
 
   std::cout << "calculating total time..." << std::endl;
@@ -87,160 +514,246 @@ int main(int argc, char *argv[])
   
   sensor_msgs::NavSatFix last_nav;
 
-  cube::MapSheet map_sheet(cube::CellCounts(100), cube::CellSizes(0.1));
+  // Each grid is written as one GeoTIFF tile, which must be a multiple of 16 cells
+  grid_size = (grid_size+15)/16*16;
+  cube::CellCounts grid_cell_counts(grid_size);
+  if(grid_size == 0)
+    grid_cell_counts = cube::MapSheet::autoCellCounts(grid_memory*1024*1024, parameters);
+  std::cout << "resolution: " << resolution << " m, grid size: " << grid_cell_counts.x << " cells" << std::endl;
+
+  cube::MapSheet map_sheet(grid_cell_counts, cell_sizes, parameters);
+
+  // Adds the transforms in a /tf or /tf_static message to the buffer,
+  // calling added(stamp) for each dynamic one.  Returns false for other
+  // messages.
+  auto add_transforms = [&](const rosbag::MessageInstance& m, std::function<void(const ros::Time&)> added)
+  {
+    if (m.getDataType() != "tf2_msgs/TFMessage" || (m.getTopic() != "/tf" && m.getTopic() != "/tf_static"))
+      return false;
+    bool is_static = m.getTopic() == "/tf_static";
+    tf2_msgs::TFMessage::ConstPtr msg = m.instantiate<tf2_msgs::TFMessage>();
+    for(const auto &t :msg->transforms)
+    {
+      tfBuffer.setTransform(t, m.getCallerId(), is_static);
+      if(!is_static)
+        added(t.header.stamp);
+    }
+    return true;
+  };
+
+  auto is_sounding = [&](const rosbag::MessageInstance& m)
+  {
+    return m.getDataType() == "sensor_msgs/PointCloud2" && (bathymetry_topic == "" || m.getTopic() == bathymetry_topic);
+  };
+
+  auto show_progress = [&](const ros::Time& stamp, const std::string& status)
+  {
+    double progress = (stamp - begin_time).toSec()/total_duration.toSec();
+    std::cout << "\r" << int(100*progress) << "%" << status;
+    std::cout.flush();
+  };
 
-  std::list<std::pair<sensor_msgs::PointCloud2::ConstPtr, sensor_msgs::NavSatFix> > soundings_buffer;
+  uint64_t bytes_read = 0;
+  auto read_start = std::chrono::steady_clock::now();
 
-  std::cout << "reading messages..." << std::endl;
+  uint64_t dropped = 0;
+  auto add_georeferenced = [&](const std::vector<cube::Sounding>& soundings)
+  {
+    map_sheet.addSoundings(soundings);
+  };
 
-  for(const auto m: view)
+  if(worker_threads == 0)
   {
-    bool check_buffer = false; // did we get a sounding or updated tf message?
+    CloudScheduler scheduler(tfBuffer, map_frame, ros::Duration(tf_wait));
+    auto add_soundings = [&](const PendingCloud& pending, const geometry_msgs::TransformStamped& transform)
+    {
+      add_georeferenced(georeference(pending, transform));
+    };
 
-    if (m.getDataType() == "tf2_msgs/TFMessage")
+    std::cout << "reading messages..." << std::endl;
+
+    for(const auto m: view)
     {
-      if(m.getTopic() == "/tf_static")
-      {
-        tf2_msgs::TFMessage::ConstPtr msg = m.instantiate<tf2_msgs::TFMessage>();
-        for(const auto &t :msg->transforms)
+      bytes_read += m.size();
+      bool check_buffer = false; // did we get a sounding or updated tf message?
+
+      ros::Time last_transform;
+      if(add_transforms(m, [&](const ros::Time& stamp)
         {
-          tfBuffer.setTransform(t, m.getCallerId(), true);
-        }
-      }
-      if(m.getTopic() == "/tf")
+          scheduler.transformAdded(stamp);
+          if(last_transform.isZero())
+            last_transform = stamp;
+        }))
       {
-        tf2_msgs::TFMessage::ConstPtr msg = m.instantiate<tf2_msgs::TFMessage>();
-        for(const auto &t :msg->transforms)
-        {
-          tfBuffer.setTransform(t, m.getCallerId(), false);
-        }
-        if(!msg->transforms.empty())
-        {
-          double progress = (msg->transforms.front().header.stamp - begin_time).toSec()/total_duration.toSec();
-          std::cout << "\r" << int(100*progress) << "%";
-          std::cout.flush();
-        }
+        if(!last_transform.isZero())
+          show_progress(last_transform, "");
         check_buffer = true;
       }
-    }
 
-    if (!nav_topic.empty() && m.getTopic() == nav_topic && m.getDataType() == "sensor_msgs/NavSatFix")
-    {
-      last_nav = *m.instantiate<sensor_msgs::NavSatFix>();
-    }
+      if (!nav_topic.empty() && m.getTopic() == nav_topic && m.getDataType() == "sensor_msgs/NavSatFix")
+      {
+        last_nav = *m.instantiate<sensor_msgs::NavSatFix>();
+      }
 
-    if (m.getDataType() == "sensor_msgs/PointCloud2")
-    {
-      if(bathymetry_topic == "" || m.getTopic() == bathymetry_topic)
+      if (is_sounding(m))
       {
         sensor_msgs::PointCloud2::ConstPtr msg = m.instantiate<sensor_msgs::PointCloud2>();
-        soundings_buffer.push_back(std::make_pair(msg, last_nav));
-
-        double progress = (msg->header.stamp - begin_time).toSec()/total_duration.toSec();
-        std::cout << "\r" << int(100*progress) << "%\t" << soundings_buffer.size() << " soundings in buffer";
-        std::cout.flush();
+        scheduler.add(msg, last_nav);
+        show_progress(msg->header.stamp, "\t" + std::to_string(scheduler.pending()) + " soundings in buffer");
         check_buffer = true;
       }
-    }
 
-    if(check_buffer)
+      if(check_buffer)
+        scheduler.release(add_soundings);
+    }
+    scheduler.flush(add_soundings);
+    dropped = scheduler.dropped();
+  }
+  else
+  {
+    // First pass: load every transform, and note the stamp of each
+    // sounding cloud so the second pass can add them to the sheet in
+    // (stamp, bag order) order, whatever order the bags hold them in.
+    std::cout << "loading transforms..." << std::endl;
+    std::vector<std::pair<ros::Time, uint64_t> > order;
+    std::vector<uint8_t> buffer;
+    for(const auto m: view)
     {
-      auto buffer_iterator = soundings_buffer.begin();
-      while(buffer_iterator != soundings_buffer.end())
-      {
-        auto msg = buffer_iterator->first;
-        auto last_nav = buffer_iterator->second;
-        try
+      bytes_read += m.size();
+      ros::Time last_transform;
+      if(add_transforms(m, [&](const ros::Time& stamp)
         {
-          auto transform = tfBuffer.lookupTransform(map_frame, msg->header.frame_id, msg->header.stamp);
-          sensor_msgs::PointCloud2 soundings_in_map_frame;
-          tf2::doTransform(*msg, soundings_in_map_frame, transform);
-
-          std::vector<cube::Sounding> soundings;
-
-          sensor_msgs::PointCloud2ConstIterator<float> iter_x_sensor(*msg, "x");
-          sensor_msgs::PointCloud2ConstIterator<float> iter_y_sensor(*msg, "y");
-          sensor_msgs::PointCloud2ConstIterator<float> iter_z_sensor(*msg, "z");
-
-          sensor_msgs::PointCloud2ConstIterator<float> iter_x(soundings_in_map_frame, "x");
-          sensor_msgs::PointCloud2ConstIterator<float> iter_y(soundings_in_map_frame, "y");
-          sensor_msgs::PointCloud2ConstIterator<float> iter_z(soundings_in_map_frame, "z");
-          for (; (iter_x != iter_x.end()) && (iter_y != iter_y.end()) && (iter_z != iter_z.end()) && (iter_x_sensor != iter_x_sensor.end()) && (iter_y_sensor != iter_y_sensor.end()) && (iter_z_sensor != iter_z_sensor.end()); ++iter_x, ++iter_y, ++iter_z, ++iter_x_sensor, ++iter_y_sensor, ++iter_z_sensor)
-          {
-            cube::Sounding s;
-            s.x = *iter_x;
-            s.y = *iter_y;
-            s.depth = -*iter_z;
-            //s.range = std::sqrt(*iter_x_sensor * *iter_x_sensor + *iter_y_sensor * *iter_y_sensor + *iter_z_sensor * *iter_z_sensor);
-            s.vertical_error = last_nav.position_covariance[8]*10.0;
-            s.horizontal_error = std::max(last_nav.position_covariance[0], last_nav.position_covariance[4])*10.0;
-
-            soundings.push_back(s);
-          }
-
-          map_sheet.addSoundings(soundings);
-          buffer_iterator = soundings_buffer.erase(buffer_iterator);
-        }
-        catch (const tf2::ExtrapolationException& e)
-        {
-          buffer_iterator++;
-        }
+          if(last_transform.isZero())
+            last_transform = stamp;
+        }) && !last_transform.isZero())
+        show_progress(last_transform, "");
+      if(is_sounding(m))
+        order.emplace_back(cloudStamp(m, buffer), order.size());
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<uint64_t> ranks(order.size());
+    for(std::size_t i = 0; i < order.size(); i++)
+      ranks[order[i].second] = i;
+    order = {};
+
+    // Second pass: the same view, so the clouds come in the same order
+    std::cout << "\nreading soundings on " << worker_threads << " threads..." << std::endl;
+    ParallelGeoreferencer georeferencer(tfBuffer, map_frame, worker_threads);
+    uint64_t sequence = 0;
+    for(const auto m: view)
+    {
+      bytes_read += m.size();
+      if (!nav_topic.empty() && m.getTopic() == nav_topic && m.getDataType() == "sensor_msgs/NavSatFix")
+      {
+        last_nav = *m.instantiate<sensor_msgs::NavSatFix>();
+      }
 
+      if (is_sounding(m))
+      {
+        // Copy out the raw message so the workers deserialise it
+        std::vector<uint8_t> serialized(m.size());
+        ros::serialization::OStream stream(serialized.data(), serialized.size());
+        m.write(stream);
+        georeferencer.add(ranks[sequence++], std::move(serialized), last_nav, add_georeferenced);
+        show_progress(m.getTime(), "");
       }
     }
+    georeferencer.finish(add_georeferenced);
+    dropped = georeferencer.dropped();
   }
+  if(dropped > 0)
+    std::cout << "\n" << dropped << " sounding messages dropped for lack of transforms";
+
+  double read_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
+  std::cout << "\nread " << bytes_read/1.0e6 << " MB in " << read_seconds << " seconds (" << bytes_read/1.0e6/std::max(read_seconds, 1e-9) << " MB/s)";
 
   std::cout << "\ndone." << std::endl;
 
+  auto histogram = map_sheet.hypothesisCountHistogram();
+  uint64_t node_count = 0;
+  uint64_t hypothesis_count = 0;
+  std::cout << "hypotheses per node:" << std::endl;
+  for(std::size_t i = 0; i < histogram.size(); i++)
+    if(histogram[i] > 0)
+    {
+      std::cout << "  " << i << ": " << histogram[i] << " nodes" << std::endl;
+      node_count += histogram[i];
+      hypothesis_count += i*histogram[i];
+    }
+  std::cout << node_count << " nodes, " << hypothesis_count << " hypotheses, approximately " << (node_count*sizeof(cube::Node) + hypothesis_count*sizeof(cube::Hypothesis))/(1024.0*1024.0) << " MiB in nodes and hypotheses" << std::endl;
+
   std::cout << "Generating output..." << std::endl;
 
   auto total_cell_counts = map_sheet.totalCellCounts();
 
   std::cout << "Total cells: " << total_cell_counts << std::endl;
 
-  GDALAllRegister();
-
-  auto driver = GetGDALDriverManager()->GetDriverByName("GTiff");
-  auto dataset = driver->Create(output_filename.c_str(), total_cell_counts.x, total_cell_counts.y, 2, GDT_Float32, nullptr);
-
   auto bounds = map_sheet.gridBounds();
   std::cout << "grid bounds: " << bounds << std::endl;
 
-  auto cellsizes = map_sheet.cellSizes();
-
-  double geo_transform[6] = {bounds.minimum.x, cellsizes.x, 0, bounds.minimum.y, 0, -cellsizes.y};
-  dataset->SetGeoTransform(geo_transform);
-
-  geometry_msgs::PointStamped p;
-  p.header.frame_id = map_frame;
-  p.header.stamp = view.getEndTime();
+  std::string projection = spatial_reference;
+  if(projection.empty())
+  {
+    geometry_msgs::PointStamped p;
+    p.header.frame_id = map_frame;
+    p.header.stamp = view.getEndTime();
 
-  auto earth_transform = tfBuffer.lookupTransform("earth", map_frame, ros::Time());
-  geometry_msgs::PointStamped origin;
-  tf2::doTransform(p, origin, earth_transform);
+    auto earth_transform = tfBuffer.lookupTransform("earth", map_frame, ros::Time());
+    geometry_msgs::PointStamped origin;
+    tf2::doTransform(p, origin, earth_transform);
 
-  std::cout << "origin: " << origin << std::endl;
+    std::cout << "origin: " << origin << std::endl;
 
-  // Example proj string: +proj=topocentric +X_0=3771793.97 +Y_0=140253.34 +Z_0=5124304.35
+    // Example proj string: +proj=topocentric +X_0=3771793.97 +Y_0=140253.34 +Z_0=5124304.35
 
-  std::stringstream projection;
-  projection << "+proj=topocentric +X_0=" << origin.point.x << " +Y_0=" << origin.point.y << " +Z_0=" << origin.point.z;
-  dataset->SetProjection(projection.str().c_str());
+    std::stringstream topocentric;
+    topocentric << "+proj=topocentric +X_0=" << origin.point.x << " +Y_0=" << origin.point.y << " +Z_0=" << origin.point.z;
+    projection = topocentric.str();
+  }
 
-  auto grids = map_sheet.grids();
-  auto cell_counts = map_sheet.cellCountsPerGrid();
-  for(auto grid: grids)
+  // The writers want WKT.  Accept EPSG codes and proj strings with -s.
+  auto to_wkt = [](const OGRSpatialReference& srs, std::string& ret)
   {
-    auto origin_index = cube::MapOffset(bounds.minimum, grid->origin())/grid->cellSizes();
-    auto values = grid->values();
-    dataset->GetRasterBand(1)->RasterIO(GF_Write, origin_index.x, origin_index.y, cell_counts.x, cell_counts.y, values.data(), cell_counts.x, cell_counts.y, GDT_Float32, 0, 0);
+    char* wkt = nullptr;
+    bool exported = srs.exportToWkt(&wkt) == OGRERR_NONE;
+    if(exported)
+      ret = wkt;
+    CPLFree(wkt);
+    return exported;
+  };
+  OGRSpatialReference srs;
+  std::string wkt;
+  if(srs.SetFromUserInput(projection.c_str()) != OGRERR_NONE || !to_wkt(srs, wkt))
+  {
+    if(!spatial_reference.empty())
+    {
+      std::cerr << "Unrecognised spatial reference: " << spatial_reference << std::endl;
+      return 1;
+    }
+    // Older versions of PROJ can't describe the topocentric frame, so
+    // fall back to a local coordinate system in meters
+    std::cerr << "Unable to convert " << projection << " to WKT, writing a local coordinate system instead. Use -s to give the map frame's coordinate system." << std::endl;
+    OGRSpatialReference local;
+    local.SetLocalCS((map_frame + " (" + projection + ")").c_str());
+    local.SetLinearUnits(SRS_UL_METER, 1.0);
+    to_wkt(local, wkt);
   }
+  projection = wkt;
 
-
-  GDALClose( (GDALDatasetH) dataset );
-
-
-
+  auto write_start = std::chrono::steady_clock::now();
+  try
+  {
+    if(write_bag)
+      cube::writeBag(map_sheet, output_filename, projection);
+    else
+      cube::writeGeoTiff(map_sheet, output_filename, projection, geotiff_options);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << "Error writing " << output_filename << ": " << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "wrote " << (write_bag ? "BAG " : geotiff_options.cloud_optimised ? "cloud optimised " : "") << output_filename << " in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - write_start).count() << " seconds" << std::endl;
 
   return 0;
 }
@@ -0,0 +1,71 @@
+#include "cube_bathymetry/bag_writer.h"
+#include "gdal_utilities.h"
+#include "cpl_string.h"
+#include <cmath>
+#include <algorithm>
+
+namespace cube
+{
+
+namespace
+{
+
+/// Null value for both BAG layers, from the BAG format specification
+constexpr float BAG_NULL = 1000000.0;
+
+} // namespace
+
+void writeBag(const MapSheet& sheet, const std::string& filename, const std::string& projection)
+{
+  auto counts = sheet.cellCountsPerGrid();
+  auto total_counts = sheet.totalCellCounts();
+  auto bounds = sheet.gridBounds();
+  auto sizes = sheet.cellSizes();
+
+  GDALAllRegister();
+  auto driver = GetGDALDriverManager()->GetDriverByName("BAG");
+  if(!driver)
+    throw std::runtime_error("GDAL BAG driver not available");
+
+  char** options = nullptr;
+  options = CSLSetNameValue(options, "BLOCK_SIZE", std::to_string(std::max(counts.x, counts.y)).c_str());
+  options = CSLSetNameValue(options, "COMPRESS", "DEFLATE");
+  DatasetPtr dataset(driver->Create(filename.c_str(), total_counts.x, total_counts.y, 2, GDT_Float32, options));
+  CSLDestroy(options);
+  if(!dataset)
+    throw std::runtime_error("unable to create " + filename + ": " + CPLGetLastErrorMsg());
+
+  /* The BAG driver wants the geotransform and projection before any data */
+  double geo_transform[6] = {bounds.minimum.x - sizes.x/2.0, sizes.x, 0, bounds.maximum.y - sizes.y/2.0, 0, -sizes.y};
+  check(dataset->SetGeoTransform(geo_transform), "setting geotransform");
+  check(dataset->SetProjection(toWkt(projection).c_str()), "setting projection");
+
+  auto elevation_band = dataset->GetRasterBand(1);
+  auto uncertainty_band = dataset->GetRasterBand(2);
+
+  auto grid_sizes = sizes*counts;
+  std::vector<float> elevation(counts.x*counts.y);
+  std::vector<float> uncertainty(counts.x*counts.y);
+  for(auto grid: sheet.grids())
+  {
+    int x = std::lround((grid->origin().x - bounds.minimum.x)/grid_sizes.x)*counts.x;
+    int y = (std::lround((bounds.maximum.y - grid->origin().y)/grid_sizes.y) - 1)*counts.y;
+
+    /* Grid rows run north from the origin, raster rows run south */
+    auto values = grid->values();
+    for(uint32_t row = 0; row < counts.y; row++)
+    {
+      auto source = values.begin() + (counts.y - 1 - row)*counts.x;
+      for(uint32_t column = 0; column < counts.x; column++, source++)
+      {
+        bool valid = !std::isnan(source->depth);
+        elevation[row*counts.x+column] = valid ? -source->depth : BAG_NULL;
+        uncertainty[row*counts.x+column] = valid ? source->uncertainty : BAG_NULL;
+      }
+    }
+    check(elevation_band->RasterIO(GF_Write, x, y, counts.x, counts.y, elevation.data(), counts.x, counts.y, GDT_Float32, 0, 0), "writing elevation");
+    check(uncertainty_band->RasterIO(GF_Write, x, y, counts.x, counts.y, uncertainty.data(), counts.x, counts.y, GDT_Float32, 0, 0), "writing uncertainty");
+  }
+}
+
+} // namespace cube
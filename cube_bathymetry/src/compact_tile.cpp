@@ -0,0 +1,228 @@
+#include "cube_bathymetry/compact_tile.h"
+#include <cmath>
+#include <limits>
+
+namespace cube
+{
+
+namespace
+{
+
+constexpr uint16_t QUANTISED_NAN = 0;
+constexpr uint32_t QUANTISED_STEPS = 65534;
+
+/// Offset and scale covering the non-NaN values of one layer, padded so
+/// later versions of the tile are likely to fit and can be sent as
+/// deltas.  The span is twice the range of the values, and at least a
+/// meter, centred on them.  Returns false if they are all NaN.
+bool quantisationRange(const std::vector<DepthAndUncertainty>& values, float DepthAndUncertainty::*layer, float& offset, float& scale)
+{
+  float minimum = std::numeric_limits<float>::max();
+  float maximum = std::numeric_limits<float>::lowest();
+  for(const auto& v: values)
+    if(!std::isnan(v.*layer))
+    {
+      minimum = std::min(minimum, v.*layer);
+      maximum = std::max(maximum, v.*layer);
+    }
+  if(minimum > maximum)
+    return false;
+  float range = maximum - minimum;
+  float span = std::max(2.0f*range, 1.0f);
+  offset = minimum - (span - range)/2.0f;
+  scale = span/QUANTISED_STEPS;
+  return true;
+}
+
+/// True if the non-NaN values of a layer can be quantised with offset and scale
+bool fits(const std::vector<DepthAndUncertainty>& values, float DepthAndUncertainty::*layer, float offset, float scale)
+{
+  for(const auto& v: values)
+    if(!std::isnan(v.*layer))
+    {
+      auto q = std::round((v.*layer - offset)/scale);
+      if(q < 0 || q > QUANTISED_STEPS)
+        return false;
+    }
+  return true;
+}
+
+std::vector<uint16_t> quantise(const std::vector<DepthAndUncertainty>& values, float DepthAndUncertainty::*layer, float offset, float scale)
+{
+  std::vector<uint16_t> ret;
+  ret.reserve(values.size());
+  for(const auto& v: values)
+    if(std::isnan(v.*layer))
+      ret.push_back(QUANTISED_NAN);
+    else
+      ret.push_back(1 + std::lround((v.*layer - offset)/scale));
+  return ret;
+}
+
+void runLengthEncode(const std::vector<uint16_t>& words, std::vector<uint16_t>& encoded)
+{
+  encoded.clear();
+  for(std::size_t i = 0; i < words.size();)
+  {
+    if(words[i] != 0)
+    {
+      encoded.push_back(words[i++]);
+      continue;
+    }
+    uint16_t run = 0;
+    while(i < words.size() && words[i] == 0 && run < std::numeric_limits<uint16_t>::max())
+    {
+      ++run;
+      ++i;
+    }
+    encoded.push_back(0);
+    encoded.push_back(run);
+  }
+}
+
+bool runLengthDecode(const std::vector<uint16_t>& encoded, std::size_t count, std::vector<uint16_t>& words)
+{
+  words.clear();
+  words.reserve(count);
+  for(std::size_t i = 0; i < encoded.size(); i++)
+  {
+    if(encoded[i] != 0)
+      words.push_back(encoded[i]);
+    else
+    {
+      if(++i == encoded.size())
+        return false;
+      words.insert(words.end(), encoded[i], 0);
+    }
+    if(words.size() > count)
+      return false;
+  }
+  return words.size() == count;
+}
+
+} // namespace
+
+std::size_t CompactTile::encodedSize() const
+{
+  return 4*sizeof(uint32_t) + 2*sizeof(int32_t) + 4*sizeof(float)
+    + sizeof(uint16_t)*(depth.size() + uncertainty.size());
+}
+
+CompactTileEncoder::CompactTileEncoder(bool delta, uint32_t key_interval)
+  :delta_(delta), key_interval_(key_interval)
+{
+
+}
+
+bool CompactTileEncoder::encode(const GridIndex& index, const CellCounts& counts, const std::vector<DepthAndUncertainty>& values, CompactTile& tile)
+{
+  tile.index = index;
+  tile.counts = counts;
+
+  float depth_offset, depth_scale, uncertainty_offset, uncertainty_scale;
+  if(!quantisationRange(values, &DepthAndUncertainty::depth, depth_offset, depth_scale) ||
+     !quantisationRange(values, &DepthAndUncertainty::uncertainty, uncertainty_offset, uncertainty_scale))
+  {
+    sent_.erase(index);
+    return false;
+  }
+
+  auto& sent = sent_[index];
+  tile.version = sent.version + 1;
+  if(tile.version == 0)
+    tile.version = 1;
+
+  bool delta = delta_ && sent.version != 0 && sent.counts == counts &&
+    (key_interval_ == 0 || tile.version % key_interval_ != 0) &&
+    fits(values, &DepthAndUncertainty::depth, sent.depth_offset, sent.depth_scale) &&
+    fits(values, &DepthAndUncertainty::uncertainty, sent.uncertainty_offset, sent.uncertainty_scale);
+
+  if(delta)
+  {
+    tile.base_version = sent.version;
+    tile.depth_offset = sent.depth_offset;
+    tile.depth_scale = sent.depth_scale;
+    tile.uncertainty_offset = sent.uncertainty_offset;
+    tile.uncertainty_scale = sent.uncertainty_scale;
+  }
+  else
+  {
+    tile.base_version = 0;
+    tile.depth_offset = depth_offset;
+    tile.depth_scale = depth_scale;
+    tile.uncertainty_offset = uncertainty_offset;
+    tile.uncertainty_scale = uncertainty_scale;
+  }
+
+  auto depth = quantise(values, &DepthAndUncertainty::depth, tile.depth_offset, tile.depth_scale);
+  auto uncertainty = quantise(values, &DepthAndUncertainty::uncertainty, tile.uncertainty_offset, tile.uncertainty_scale);
+
+  if(delta)
+  {
+    /* Unchanged cells become zero and collapse into runs */
+    std::vector<uint16_t> depth_delta(depth.size()), uncertainty_delta(uncertainty.size());
+    for(std::size_t i = 0; i < depth.size(); i++)
+    {
+      depth_delta[i] = depth[i] - sent.depth[i];
+      uncertainty_delta[i] = uncertainty[i] - sent.uncertainty[i];
+    }
+    runLengthEncode(depth_delta, tile.depth);
+    runLengthEncode(uncertainty_delta, tile.uncertainty);
+  }
+  else
+  {
+    runLengthEncode(depth, tile.depth);
+    runLengthEncode(uncertainty, tile.uncertainty);
+  }
+
+  sent.version = tile.version;
+  sent.counts = counts;
+  sent.depth_offset = tile.depth_offset;
+  sent.depth_scale = tile.depth_scale;
+  sent.uncertainty_offset = tile.uncertainty_offset;
+  sent.uncertainty_scale = tile.uncertainty_scale;
+  sent.depth.swap(depth);
+  sent.uncertainty.swap(uncertainty);
+  return true;
+}
+
+bool CompactTileDecoder::decode(const CompactTile& tile, std::vector<DepthAndUncertainty>& values)
+{
+  std::size_t count = std::size_t(tile.counts.x)*tile.counts.y;
+  std::vector<uint16_t> depth, uncertainty;
+  if(!runLengthDecode(tile.depth, count, depth) || !runLengthDecode(tile.uncertainty, count, uncertainty))
+    return false;
+
+  if(tile.base_version != 0)
+  {
+    auto base = received_.find(tile.index);
+    if(base == received_.end() || base->second.version != tile.base_version || base->second.depth.size() != count)
+      return false;
+    for(std::size_t i = 0; i < count; i++)
+    {
+      depth[i] += base->second.depth[i];
+      uncertainty[i] += base->second.uncertainty[i];
+    }
+  }
+
+  values.resize(count);
+  for(std::size_t i = 0; i < count; i++)
+  {
+    if(depth[i] == QUANTISED_NAN)
+      values[i].depth = std::numeric_limits<float>::quiet_NaN();
+    else
+      values[i].depth = tile.depth_offset + (depth[i] - 1)*tile.depth_scale;
+    if(uncertainty[i] == QUANTISED_NAN)
+      values[i].uncertainty = std::numeric_limits<float>::quiet_NaN();
+    else
+      values[i].uncertainty = tile.uncertainty_offset + (uncertainty[i] - 1)*tile.uncertainty_scale;
+  }
+
+  auto& received = received_[tile.index];
+  received.version = tile.version;
+  received.depth.swap(depth);
+  received.uncertainty.swap(uncertainty);
+  return true;
+}
+
+} // namespace cube
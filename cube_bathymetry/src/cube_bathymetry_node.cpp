@@ -4,25 +4,260 @@
 #include <cube_bathymetry/map_sheet.h>
 #include <tf2_ros/transform_listener.h>
 #include <geometry_msgs/TransformStamped.h>
-#include "tf2_ros/message_filter.h"
-#include "message_filters/subscriber.h"
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <tf2_sensor_msgs/tf2_sensor_msgs.h>
 #include <grid_map_ros/grid_map_ros.hpp>
 #include <grid_map_msgs/GridMap.h>
+#include <diagnostic_updater/diagnostic_updater.h>
+#include <ros/callback_queue.h>
+#include <cube_bathymetry/QueryPoint.h>
+#include <cube_bathymetry/QueryBox.h>
+#include <cube_bathymetry/CompactSurface.h>
+#include <cube_bathymetry/compact_tile.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <unistd.h>
 
 std::shared_ptr<cube::MapSheet> map_sheet;
+
+/// Guards map_sheet, which is shared by the ingest and publish threads
+std::mutex map_sheet_mutex;
+
 std::shared_ptr<tf2_ros::Buffer> tfBuffer;
 std::string map_frame = "map";
-ros::Time last_grid_publish_time;
+ros::Duration publish_period(5.0);
+ros::Duration full_publish_period(60.0);
 ros::Publisher grid_publisher;
+ros::Publisher tile_publisher;
+
+/// Publish the hypothesis count, strength ratio and sample count layers
+/// with the surface
+bool extra_layers = false;
+
+/// Optional compact publication for low bandwidth links.  The encoder is
+/// only used by the publish thread.
+bool compact_enabled = false;
+ros::Publisher compact_publisher;
+std::shared_ptr<cube::CompactTileEncoder> compact_encoder;
+std::atomic<uint64_t> compact_bytes(0);
+std::atomic<uint64_t> compact_float_bytes(0);
+
+/// Sheet update count included in the last publication of updated
+/// grids.  Full publications don't move it, so subscribers that only
+/// follow grid_updates still receive every change.
+uint64_t last_published_update = 0;
+
+/// Update of each grid when it was last extracted for grid_updates, so
+/// soundings added while a publication was being extracted are sent
+/// once, in the next publication, if they missed the extraction.  Only
+/// used by the publish thread.
+std::map<cube::GridIndex, uint64_t> published_grid_updates;
+
+/// A ping whose soundings are in the sheet but not yet published
+struct IngestedPing
+{
+  uint64_t update;
+  ros::Time stamp;
+  ros::WallTime ingested;
+};
+
+/// Ingested pings in update order, guarded by map_sheet_mutex.  The
+/// publish threads takes those included in each publication to measure
+/// how long soundings take to appear in the published surface.
+std::deque<IngestedPing> unpublished_pings;
+const std::size_t maximum_unpublished_pings = 10000;
+
+/// A ping waiting for its transform to the map frame
+struct PendingPing
+{
+  sensor_msgs::PointCloud2::ConstPtr message;
+
+  /// When the ingest thread first looked for the ping's transform, or
+  /// zero if it hasn't yet
+  ros::WallTime first_checked;
+};
+
+/// Pings waiting for the ingest thread, keyed by stamp.  The subscriber
+/// callback only adds to this queue.  The ingest thread releases the
+/// oldest ping whose transform is available, skipping any still waiting
+/// for theirs, and drops a ping if its transform isn't available within
+/// tf_timeout of it first being checked.  When the queue is full the
+/// oldest ping is dropped.
+std::multimap<ros::Time, PendingPing> ping_queue;
+std::mutex ping_queue_mutex;
+std::condition_variable ping_queue_condition;
+std::size_t ping_queue_capacity = 100;
+ros::WallDuration tf_timeout(1.0);
+
+/// Histogram of durations recorded between diagnostics updates.  Bins
+/// double in width from 1ms, so adding a sample is a few instructions
+/// and percentiles are reported to within a factor of two.
+class LatencyHistogram
+{
+public:
+  static constexpr std::size_t bin_count = 18;
 
-void publishGrid()
+  void add(double seconds)
+  {
+    std::size_t bin = 0;
+    double upper = first_bin_limit;
+    while(seconds > upper && bin < bin_count-1)
+    {
+      upper *= 2.0;
+      ++bin;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++bins_[bin];
+    ++count_;
+    sum_ += seconds;
+    maximum_ = std::max(maximum_, seconds);
+  }
+
+  /// Add the count, mean, percentiles and maximum to status, prefixed
+  /// by label, and reset the histogram
+  void report(diagnostic_updater::DiagnosticStatusWrapper& status, const std::string& label)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    status.add(label+" count", count_);
+    if(count_ > 0)
+    {
+      status.add(label+" mean (s)", sum_/count_);
+      status.add(label+" p50 (s)", percentile(0.5));
+      status.add(label+" p95 (s)", percentile(0.95));
+      status.add(label+" p99 (s)", percentile(0.99));
+      status.add(label+" max (s)", maximum_);
+    }
+    bins_.fill(0);
+    count_ = 0;
+    sum_ = 0.0;
+    maximum_ = 0.0;
+  }
+
+private:
+  static constexpr double first_bin_limit = 0.001;
+
+  /// Upper limit of the bin containing fraction of the samples
+  double percentile(double fraction) const
+  {
+    uint64_t target = std::ceil(fraction*count_);
+    uint64_t seen = 0;
+    double upper = first_bin_limit;
+    for(std::size_t bin = 0; bin < bin_count; bin++, upper *= 2.0)
+    {
+      seen += bins_[bin];
+      if(seen >= target)
+        return std::min(upper, maximum_);
+    }
+    return maximum_;
+  }
+
+  std::mutex mutex_;
+  std::array<uint64_t, bin_count> bins_ {};
+  uint64_t count_ = 0;
+  double sum_ = 0.0;
+  double maximum_ = 0.0;
+};
+
+LatencyHistogram tf_wait_latency;
+LatencyHistogram ingest_lag_latency;
+LatencyHistogram georeference_latency;
+LatencyHistogram sheet_update_latency;
+LatencyHistogram ping_to_ingested_latency;
+LatencyHistogram ingested_to_published_latency;
+LatencyHistogram ping_to_published_latency;
+LatencyHistogram full_publish_latency;
+LatencyHistogram update_publish_latency;
+
+/// Load shedding.  When the lag between a ping's stamp and its release
+/// to ingestion exceeds maximum_ingest_lag, only every decimation-th
+/// ping is ingested.  The decimation doubles while the lag stays above
+/// the threshold and halves once it falls below half of it, changing at
+/// most once per decimation_interval.  A non-positive maximum_ingest_lag
+/// disables shedding.
+ros::Duration maximum_ingest_lag(2.0);
+ros::WallDuration decimation_interval(2.0);
+const uint32_t maximum_decimation = 64;
+std::atomic<uint32_t> decimation(1);
+
+/// Counters reported on the diagnostics topic
+std::atomic<uint64_t> pings_received(0);
+std::atomic<uint64_t> pings_dropped(0);
+std::atomic<uint64_t> pings_tf_timed_out(0);
+std::atomic<uint64_t> pings_shed(0);
+std::atomic<uint64_t> soundings_shed(0);
+std::atomic<uint64_t> pings_ingested(0);
+std::atomic<uint64_t> soundings_ingested(0);
+std::atomic<uint64_t> publish_count(0);
+
+std::string hypothesisHistogram()
+{
+  std::vector<uint64_t> histogram;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    histogram = map_sheet->hypothesisCountHistogram();
+  }
+  std::stringstream ret;
+  for(std::size_t i = 0; i < histogram.size(); i++)
+    if(histogram[i] > 0)
+      ret << " " << i << ": " << histogram[i];
+  return ret.str();
+}
+
+/// Values extracted from a grid, so a GridMap can be built from them
+/// without holding map_sheet_mutex.
+struct GridValues
+{
+  cube::MapPosition origin;
+  cube::CellCounts counts;
+  std::vector<cube::DepthAndUncertainty> values;
+
+  /// Update and time of the newest soundings in the values, read under
+  /// the same lock as them
+  uint64_t update;
+  std::chrono::steady_clock::time_point time;
+
+  /// All the layers, only filled when extra_layers is set
+  std::vector<cube::NodeValues> layers;
+};
+
+/// Extract the values of the grids, locking the sheet for one grid at a
+/// time so that ingestion can proceed in between.
+std::vector<GridValues> extractValues(const std::vector<std::shared_ptr<cube::Grid> >& grids)
+{
+  std::vector<GridValues> ret;
+  for(auto grid: grids)
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    if(!extra_layers)
+    {
+      ret.push_back({grid->origin(), grid->cellCounts(), grid->values(), grid->lastUpdate(), grid->lastUpdateTime(), {}});
+      continue;
+    }
+
+    /* One pass over the nodes for all the layers */
+    GridValues values{grid->origin(), grid->cellCounts(), {}, grid->lastUpdate(), grid->lastUpdateTime(), grid->nodeValues()};
+    values.values.reserve(values.layers.size());
+    for(const auto& v: values.layers)
+      values.values.emplace_back(v.depth, v.uncertainty);
+    ret.push_back(std::move(values));
+  }
+  return ret;
+}
+
+/// Build a GridMap covering bounds from the given grid values.  Cells are
+/// centred on the CUBE nodes, which sit at the grid origin plus whole
+/// multiples of the cell size.
+grid_map::GridMap toGridMap(const cube::MapBounds& bounds, const std::vector<GridValues>& grids, std::chrono::steady_clock::time_point time)
 {
   grid_map::GridMap map;
 
-  auto bounds = map_sheet->gridBounds();
-  auto cell_counts = map_sheet->totalCellCounts();
   auto cell_sizes = map_sheet->cellSizes();
 
   auto width = bounds.maximum.x - bounds.minimum.x;
@@ -30,62 +265,240 @@ void publishGrid()
 
   map.setGeometry(grid_map::Length(width, height), cell_sizes.x);
 
-  grid_map::Position center(bounds.minimum.x+width/2.0, bounds.minimum.y+height/2.0);
+  grid_map::Position center(bounds.minimum.x+(width-cell_sizes.x)/2.0, bounds.minimum.y+(height-cell_sizes.y)/2.0);
 
   map.setPosition(center);
   map.setFrameId(map_frame);
 
   auto epoch = std::chrono::time_point<std::chrono::steady_clock>{};
-  map.setTimestamp(std::chrono::duration_cast<std::chrono::nanoseconds>((map_sheet->lastUpdateTime()-epoch)).count());
+  map.setTimestamp(std::chrono::duration_cast<std::chrono::nanoseconds>((time-epoch)).count());
 
   map.add("elevation");
   map.add("uncertainty");
+  if(extra_layers)
+  {
+    map.add("hypothesis_count");
+    map.add("hypothesis_strength_ratio");
+    map.add("sample_count");
+  }
 
-  for(auto grid: map_sheet->grids())
+  /* The GridMap buffer starts at the maximum x and y corner with rows
+   * along x and columns along y, so each row of a grid lands in a
+   * reversed, contiguous segment of one matrix column.  The offset of
+   * each grid in the matrix is computed once and whole rows are copied.
+   */
+  static_assert(sizeof(cube::DepthAndUncertainty) == 2*sizeof(float), "DepthAndUncertainty must be two packed floats");
+  using StridedValues = Eigen::Map<const Eigen::VectorXf, 0, Eigen::InnerStride<2> >;
+
+  auto& elevation = map.get("elevation");
+  auto& uncertainty = map.get("uncertainty");
+  auto hypothesis_count = extra_layers ? &map.get("hypothesis_count") : nullptr;
+  auto ratio = extra_layers ? &map.get("hypothesis_strength_ratio") : nullptr;
+  auto sample_count = extra_layers ? &map.get("sample_count") : nullptr;
+  auto size = map.getSize();
+
+  for(const auto& grid: grids)
   {
-    auto origin = grid->origin();
-    auto counts = grid->cellCounts();
-    auto sizes = grid->cellSizes();
-    auto values = grid->values();
+    const auto& counts = grid.counts;
 
-    for(int j = 0; j < counts.y; j++)
-      for(int i = 0; i < counts.x; i++)
-      {
-        auto grid_index = j*counts.x + i;
-        auto depth_uncertainty = values[grid_index];
-        if(!std::isnan(depth_uncertainty.depth))
-        {
-          grid_map::Position p(origin.x + i*sizes.x, origin.y + j*sizes.y);
-          grid_map::Index index;
-            if(map.getIndex(p,index))
-            {
-              map.at("elevation", index) = -depth_uncertainty.depth;
-              map.at("uncertainty", index) = depth_uncertainty.uncertainty;
-            }
-        }
+    int column_offset = std::lround((grid.origin.x - bounds.minimum.x)/cell_sizes.x);
+    int row_offset = std::lround((grid.origin.y - bounds.minimum.y)/cell_sizes.y);
+
+    int i = size(0) - column_offset - int(counts.x);
+    if(i < 0 || column_offset < 0)
+      continue;
 
+    for(int row = 0; row < counts.y; row++)
+    {
+      int j = size(1) - 1 - (row_offset + row);
+      if(j < 0 || j >= size(1))
+        continue;
+
+      const float* values_row = &grid.values[row*counts.x].depth;
+      elevation.col(j).segment(i, counts.x) = -StridedValues(values_row, counts.x).reverse();
+      uncertainty.col(j).segment(i, counts.x) = StridedValues(values_row+1, counts.x).reverse();
+
+      if(grid.layers.empty())
+        continue;
+      for(int column = 0; column < counts.x; column++)
+      {
+        const auto& v = grid.layers[row*counts.x+column];
+        int k = i + counts.x - 1 - column;
+        if(std::isnan(v.depth))
+          continue;
+        (*hypothesis_count)(k, j) = v.hypothesis_count;
+        (*ratio)(k, j) = v.ratio;
+        (*sample_count)(k, j) = v.sample_count;
       }
+    }
+  }
+  return map;
+}
 
+/// Remove the pings included up to update from unpublished_pings.  Must
+/// be called with map_sheet_mutex held.
+std::vector<IngestedPing> takePublishedPings(uint64_t update)
+{
+  std::vector<IngestedPing> ret;
+  while(!unpublished_pings.empty() && unpublished_pings.front().update <= update)
+  {
+    ret.push_back(unpublished_pings.front());
+    unpublished_pings.pop_front();
   }
+  return ret;
+}
+
+/// Record the latencies of pings that have just been published
+void recordPublished(const std::vector<IngestedPing>& pings)
+{
+  auto wall_now = ros::WallTime::now();
+  auto now = ros::Time::now();
+  for(const auto& ping: pings)
+  {
+    ingested_to_published_latency.add((wall_now - ping.ingested).toSec());
+    ping_to_published_latency.add((now - ping.stamp).toSec());
+  }
+}
+
+ros::Time toRosTime(std::chrono::steady_clock::time_point time)
+{
+  auto epoch = std::chrono::time_point<std::chrono::steady_clock>{};
+  ros::Time ret;
+  ret.fromNSec(std::chrono::duration_cast<std::chrono::nanoseconds>(time-epoch).count());
+  return ret;
+}
+
+/// Publish the grids as compact tiles, skipping the ones with no data
+void publishCompact(const std::vector<GridValues>& grids, std::chrono::steady_clock::time_point time)
+{
+  if(!compact_enabled)
+    return;
+
+  cube_bathymetry::CompactSurface message;
+  message.header.stamp = toRosTime(time);
+  message.header.frame_id = map_frame;
+  message.resolution = map_sheet->cellSizes().x;
+
+  std::size_t bytes = 0;
+  std::size_t float_bytes = 0;
+  cube::CompactTile tile;
+  for(const auto& grid: grids)
+  {
+    float_bytes += grid.values.size()*sizeof(cube::DepthAndUncertainty);
+    // offset by half a cell so rounding can't pick a neighbouring grid
+    auto index = map_sheet->gridIndex(cube::MapPosition(grid.origin.x+map_sheet->cellSizes().x/2.0, grid.origin.y+map_sheet->cellSizes().y/2.0));
+    if(!compact_encoder->encode(index, grid.counts, grid.values, tile))
+      continue;
+    bytes += tile.encodedSize();
+
+    cube_bathymetry::CompactTile t;
+    t.grid_x = tile.index.x;
+    t.grid_y = tile.index.y;
+    t.columns = tile.counts.x;
+    t.rows = tile.counts.y;
+    t.version = tile.version;
+    t.base_version = tile.base_version;
+    t.depth_offset = tile.depth_offset;
+    t.depth_scale = tile.depth_scale;
+    t.uncertainty_offset = tile.uncertainty_offset;
+    t.uncertainty_scale = tile.uncertainty_scale;
+    t.depth.swap(tile.depth);
+    t.uncertainty.swap(tile.uncertainty);
+    message.tiles.push_back(t);
+  }
+  compact_bytes += bytes;
+  compact_float_bytes += float_bytes;
+  if(!message.tiles.empty())
+    compact_publisher.publish(message);
+}
+
+/// Publish the whole sheet as a single GridMap, stamped with the time of
+/// the newest soundings in it
+void publishGrid()
+{
+  std::vector<std::shared_ptr<cube::Grid> > grids;
+  cube::MapBounds bounds;
+  std::vector<IngestedPing> published_pings;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    published_pings = takePublishedPings(map_sheet->updateCount());
+    grids = map_sheet->grids();
+    bounds = map_sheet->gridBounds();
+  }
+
+  auto values = extractValues(grids);
+  std::chrono::steady_clock::time_point time;
+  for(const auto& v: values)
+    time = std::max(time, v.time);
+  auto map = toGridMap(bounds, values, time);
+
+  ROS_INFO_STREAM_THROTTLE(60.0, "hypotheses per node:" << hypothesisHistogram());
+
   grid_map_msgs::GridMap message;
   grid_map::GridMapRosConverter::toMessage(map, message);
   grid_publisher.publish(message);
+  publishCompact(values, time);
+  recordPublished(published_pings);
+  ++publish_count;
 }
 
-void pingCallback(const sensor_msgs::PointCloud2::ConstPtr msg)
+/// Publish each grid that received soundings since the last publish as
+/// its own GridMap, so the cost follows the changed area rather than the
+/// size of the sheet.  Each GridMap is stamped with the time of the
+/// newest soundings in its grid.
+void publishUpdatedGrids()
+{
+  std::map<cube::GridIndex, std::shared_ptr<cube::Grid> > updated_grids;
+  std::vector<IngestedPing> published_pings;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    updated_grids = map_sheet->gridsUpdatedSince(last_published_update);
+    last_published_update = map_sheet->updateCount();
+    published_pings = takePublishedPings(last_published_update);
+    for(auto g = updated_grids.begin(); g != updated_grids.end();)
+    {
+      // already sent if its last extraction came after its last update
+      auto published = published_grid_updates.find(g->first);
+      if(published != published_grid_updates.end() && g->second->lastUpdate() <= published->second)
+        g = updated_grids.erase(g);
+      else
+        ++g;
+    }
+  }
+
+  std::vector<GridValues> compact_values;
+  std::chrono::steady_clock::time_point newest_time;
+  for(const auto& g: updated_grids)
+  {
+    auto values = extractValues({g.second});
+    published_grid_updates[g.first] = values.front().update;
+    auto map = toGridMap(g.second->bounds(), values, values.front().time);
+    grid_map_msgs::GridMap message;
+    grid_map::GridMapRosConverter::toMessage(map, message);
+    tile_publisher.publish(message);
+    newest_time = std::max(newest_time, values.front().time);
+    if(compact_enabled)
+      compact_values.push_back(std::move(values.front()));
+  }
+  publishCompact(compact_values, newest_time);
+  recordPublished(published_pings);
+  ++publish_count;
+  ROS_DEBUG_STREAM("published " << updated_grids.size() << " updated grids");
+}
+
+/// Georeference a ping and add its soundings to the sheet
+void ingestPing(const sensor_msgs::PointCloud2::ConstPtr& msg)
 {
-  ROS_INFO_STREAM(msg->header);
+  ROS_DEBUG_STREAM(msg->header);
   try
   {
-    auto transform = tfBuffer->lookupTransform(map_frame, msg->header.frame_id, msg->header.stamp, ros::Duration(1.0));
+    auto start = ros::WallTime::now();
+    auto transform = tfBuffer->lookupTransform(map_frame, msg->header.frame_id, msg->header.stamp);
     sensor_msgs::PointCloud2 soundings_in_map_frame;
     tf2::doTransform(*msg, soundings_in_map_frame, transform);
 
     std::vector<cube::Sounding> soundings;
 
-    sensor_msgs::PointCloud2ConstIterator<float> iter_original_z(*msg, "z");
-
-
     sensor_msgs::PointCloud2ConstIterator<float> iter_x(soundings_in_map_frame, "x");
     sensor_msgs::PointCloud2ConstIterator<float> iter_y(soundings_in_map_frame, "y");
     sensor_msgs::PointCloud2ConstIterator<float> iter_z(soundings_in_map_frame, "z");
@@ -103,32 +516,401 @@ void pingCallback(const sensor_msgs::PointCloud2::ConstPtr msg)
            (iter_horizontal_uncertainty != iter_horizontal_uncertainty.end());
            ++iter_x, ++iter_y, ++iter_z,
            ++iter_vertical_uncertainty, ++iter_horizontal_uncertainty)
-          {
-            cube::Sounding s;
-            s.x = *iter_x;
-            s.y = *iter_y;
-            s.depth = -*iter_z;
-            s.vertical_error =  *iter_vertical_uncertainty;
-            s.horizontal_error = *iter_horizontal_uncertainty;
-            soundings.push_back(s);
-          }
-
-          map_sheet->addSoundings(soundings, timestamp);
-    
-    if(last_grid_publish_time.isZero() || msg->header.stamp - last_grid_publish_time > ros::Duration(5.0))
     {
-      publishGrid();
-      last_grid_publish_time = msg->header.stamp;
+      cube::Sounding s;
+      s.x = *iter_x;
+      s.y = *iter_y;
+      s.depth = -*iter_z;
+      s.vertical_error =  *iter_vertical_uncertainty;
+      s.horizontal_error = *iter_horizontal_uncertainty;
+      soundings.push_back(s);
     }
 
-
+    auto georeferenced = ros::WallTime::now();
+    georeference_latency.add((georeferenced - start).toSec());
+    {
+      std::lock_guard<std::mutex> lock(map_sheet_mutex);
+      auto update = map_sheet->updateCount();
+      map_sheet->addSoundings(soundings, timestamp);
+      if(map_sheet->updateCount() != update)
+      {
+        if(unpublished_pings.size() >= maximum_unpublished_pings)
+          unpublished_pings.pop_front();
+        unpublished_pings.push_back({map_sheet->updateCount(), msg->header.stamp, ros::WallTime::now()});
+      }
+    }
+    sheet_update_latency.add((ros::WallTime::now() - georeferenced).toSec());
+    ping_to_ingested_latency.add((ros::Time::now() - msg->header.stamp).toSec());
+    ++pings_ingested;
+    soundings_ingested += soundings.size();
   }
   catch (const tf2::TransformException& e)
   {
     ROS_WARN_STREAM("tf2 exception: " << e.what());
   }
+}
+
+/// Adjust the decimation for the lag of a released ping and decide
+/// whether to ingest it.  Only called from the ingest thread.
+bool keepPing(const ros::Duration& lag)
+{
+  static uint64_t sequence = 0;
+  static ros::WallTime last_change;
+
+  if(maximum_ingest_lag <= ros::Duration(0.0))
+    return true;
+
+  auto now = ros::WallTime::now();
+  if(now - last_change > decimation_interval)
+  {
+    uint32_t level = decimation;
+    if(lag > maximum_ingest_lag && level < maximum_decimation)
+      level *= 2;
+    else if(lag < maximum_ingest_lag*0.5 && level > 1)
+      level /= 2;
+    if(level != decimation)
+    {
+      if(level > decimation)
+        ROS_WARN_STREAM("Ingest lag " << lag.toSec() << "s, keeping 1 in " << level << " pings");
+      else
+        ROS_INFO_STREAM("Ingest lag " << lag.toSec() << "s, keeping 1 in " << level << " pings");
+      decimation = level;
+      last_change = now;
+      sequence = 0;
+    }
+  }
+  return sequence++ % decimation == 0;
+}
+
+/// Queue a ping for the ingest thread
+void pingCallback(const sensor_msgs::PointCloud2::ConstPtr msg)
+{
+  ++pings_received;
+  {
+    std::lock_guard<std::mutex> lock(ping_queue_mutex);
+    if(ping_queue.size() >= ping_queue_capacity)
+    {
+      ping_queue.erase(ping_queue.begin());
+      ++pings_dropped;
+    }
+    ping_queue.emplace(msg->header.stamp, PendingPing{msg, ros::WallTime()});
+  }
+  ping_queue_condition.notify_one();
+}
+
+/// Remove a ping from the queue.  Returns false if the callback already
+/// dropped it to make room.
+bool removePing(const PendingPing& ping)
+{
+  auto range = ping_queue.equal_range(ping.message->header.stamp);
+  for(auto i = range.first; i != range.second; ++i)
+    if(i->second.message == ping.message)
+    {
+      ping_queue.erase(i);
+      return true;
+    }
+  return false;
+}
+
+/// Release pings from the queue in stamp order as their transforms
+/// become available and ingest them until shutdown.  A ping whose
+/// transform isn't available yet doesn't hold up later pings that have
+/// theirs.  The transforms are checked with canTransform outside the
+/// queue lock, so neither tf2 nor the subscriber callback is blocked.
+void ingestThread()
+{
+  std::vector<PendingPing> candidates;
+  while(ros::ok())
+  {
+    candidates.clear();
+    {
+      std::unique_lock<std::mutex> lock(ping_queue_mutex);
+      ping_queue_condition.wait_for(lock, std::chrono::milliseconds(100), []{return !ping_queue.empty();});
+      auto now = ros::WallTime::now();
+      for(auto& p: ping_queue)
+      {
+        if(p.second.first_checked.isZero())
+          p.second.first_checked = now;
+        candidates.push_back(p.second);
+      }
+    }
+    if(candidates.empty())
+      continue;
 
+    PendingPing ping;
+    std::vector<PendingPing> timed_out;
+    for(const auto& candidate: candidates)
+    {
+      const auto& header = candidate.message->header;
+      if(tfBuffer->canTransform(map_frame, header.frame_id, header.stamp))
+      {
+        ping = candidate;
+        break;
+      }
+      if(ros::WallTime::now() - candidate.first_checked > tf_timeout)
+        timed_out.push_back(candidate);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(ping_queue_mutex);
+      for(const auto& p: timed_out)
+        if(removePing(p))
+        {
+          ROS_WARN_STREAM_THROTTLE(1.0, "Dropping ping at " << p.message->header.stamp << ": no transform from " << p.message->header.frame_id << " to " << map_frame);
+          ++pings_tf_timed_out;
+        }
+      if(!ping.message)
+      {
+        // wait for transforms or pings to arrive
+        ping_queue_condition.wait_for(lock, std::chrono::milliseconds(10));
+        continue;
+      }
+      if(!removePing(ping))
+        continue;
+    }
 
+    tf_wait_latency.add((ros::WallTime::now() - ping.first_checked).toSec());
+    auto lag = ros::Time::now() - ping.message->header.stamp;
+    ingest_lag_latency.add(lag.toSec());
+    if(keepPing(lag))
+      ingestPing(ping.message);
+    else
+    {
+      ++pings_shed;
+      soundings_shed += uint64_t(ping.message->width)*ping.message->height;
+    }
+  }
+}
+
+/// Publish updated grids every publish_period and the whole sheet every
+/// full_publish_period until shutdown
+void publishThread()
+{
+  ros::Rate rate(1.0/publish_period.toSec());
+  ros::Time last_full_publish_time;
+  while(ros::ok())
+  {
+    rate.sleep();
+    auto now = ros::Time::now();
+    auto start = ros::WallTime::now();
+    if(last_full_publish_time.isZero() || now - last_full_publish_time > full_publish_period)
+    {
+      publishGrid();
+      last_full_publish_time = now;
+      full_publish_latency.add((ros::WallTime::now() - start).toSec());
+    }
+    else
+    {
+      publishUpdatedGrids();
+      update_publish_latency.add((ros::WallTime::now() - start).toSec());
+    }
+  }
+}
+
+/// Default limit on the nodes returned by a box query
+uint32_t maximum_query_nodes = 10000;
+
+/// Largest box, in square meters, a box query may cover
+double maximum_query_area = 1e6;
+
+void toMessage(const cube::NodeQuery& query, cube_bathymetry::NodeHypotheses& message)
+{
+  message.position.x = query.position.x;
+  message.position.y = query.position.y;
+  message.depth = query.estimate.depth;
+  message.uncertainty = query.estimate.uncertainty;
+  message.hypotheses.resize(query.hypotheses.size());
+  for(std::size_t i = 0; i < query.hypotheses.size(); i++)
+  {
+    message.hypotheses[i].depth = query.hypotheses[i].depth;
+    message.hypotheses[i].confidence_interval = query.hypotheses[i].confidence_interval;
+    message.hypotheses[i].sample_count = query.hypotheses[i].sample_count;
+  }
+  message.nominated = query.nominated;
+  message.queued = query.queued;
+}
+
+/// Answer a point query straight from the sheet.  The sheet is locked
+/// only for the lookup of a single node.
+bool queryPoint(cube_bathymetry::QueryPoint::Request& request, cube_bathymetry::QueryPoint::Response& response)
+{
+  cube::NodeQuery query;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    response.found = map_sheet->queryNode(cube::MapPosition(request.position.x, request.position.y), query);
+  }
+  if(response.found)
+    toMessage(query, response.node);
+  return true;
+}
+
+bool queryBox(cube_bathymetry::QueryBox::Request& request, cube_bathymetry::QueryBox::Response& response)
+{
+  cube::MapBounds bounds(cube::MapPosition(request.minimum.x, request.minimum.y), cube::MapPosition(request.maximum.x, request.maximum.y));
+  std::size_t maximum_nodes = maximum_query_nodes;
+  if(request.maximum_nodes > 0)
+    maximum_nodes = std::min(request.maximum_nodes, maximum_query_nodes);
+
+  auto area = std::max(0.0, bounds.maximum.x - bounds.minimum.x)*std::max(0.0, bounds.maximum.y - bounds.minimum.y);
+  if(area > maximum_query_area)
+  {
+    ROS_WARN_STREAM("rejected query_box of " << area << " m^2, more than ~max_query_area (" << maximum_query_area << " m^2)");
+    return false;
+  }
+
+  std::vector<cube::NodeQuery> queries;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    response.truncated = !map_sheet->queryNodes(bounds, maximum_nodes, queries);
+  }
+  response.nodes.resize(queries.size());
+  for(std::size_t i = 0; i < queries.size(); i++)
+    toMessage(queries[i], response.nodes[i]);
+  return true;
+}
+
+/// Resident set size of the process in bytes, or 0 if unavailable
+uint64_t residentMemory()
+{
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size, resident;
+  if(statm >> size >> resident)
+    return resident*sysconf(_SC_PAGESIZE);
+  return 0;
+}
+
+/// Grids, nodes and hypotheses held by the sheet.  Counting them walks
+/// every node with the sheet locked, so the diagnostics only refresh
+/// them every resident_period.
+struct ResidentCounts
+{
+  std::size_t grids = 0;
+  uint64_t nodes = 0;
+  uint64_t hypotheses = 0;
+};
+
+ros::WallDuration resident_period(10.0);
+
+ResidentCounts residentCounts()
+{
+  ResidentCounts ret;
+  std::vector<uint64_t> histogram;
+  {
+    std::lock_guard<std::mutex> lock(map_sheet_mutex);
+    ret.grids = map_sheet->grids().size();
+    histogram = map_sheet->hypothesisCountHistogram();
+  }
+  for(std::size_t i = 0; i < histogram.size(); i++)
+  {
+    ret.nodes += histogram[i];
+    ret.hypotheses += i*histogram[i];
+  }
+  return ret;
+}
+
+void updateDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& status)
+{
+  static uint64_t last_dropped = 0;
+  static uint64_t last_soundings = 0;
+  static ros::WallTime last_time = ros::WallTime::now();
+  static ResidentCounts resident;
+  static ros::WallTime last_resident_time;
+
+  auto now = ros::WallTime::now();
+  uint64_t soundings = soundings_ingested;
+  double soundings_rate = 0.0;
+  if(now > last_time)
+    soundings_rate = (soundings - last_soundings)/(now - last_time).toSec();
+  last_soundings = soundings;
+  last_time = now;
+
+  if(last_resident_time.isZero() || now - last_resident_time > resident_period)
+  {
+    resident = residentCounts();
+    last_resident_time = now;
+  }
+
+  std::size_t queue_depth;
+  {
+    std::lock_guard<std::mutex> lock(ping_queue_mutex);
+    queue_depth = ping_queue.size();
+  }
+  uint64_t dropped = pings_dropped + pings_tf_timed_out;
+
+  if(dropped > last_dropped)
+    status.summary(diagnostic_msgs::DiagnosticStatus::WARN, "Dropping pings");
+  else if(decimation > 1)
+    status.summary(diagnostic_msgs::DiagnosticStatus::WARN, "Shedding load");
+  else
+    status.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+  last_dropped = dropped;
+
+  status.add("ping queue depth", queue_depth);
+  status.add("ping queue capacity", ping_queue_capacity);
+  status.add("pings received", uint64_t(pings_received));
+  status.add("pings dropped on full queue", uint64_t(pings_dropped));
+  status.add("pings dropped on tf timeout", uint64_t(pings_tf_timed_out));
+  tf_wait_latency.report(status, "tf wait");
+  ingest_lag_latency.report(status, "ingest lag");
+  georeference_latency.report(status, "georeference");
+  sheet_update_latency.report(status, "sheet update");
+  ping_to_ingested_latency.report(status, "ping to ingested");
+  ingested_to_published_latency.report(status, "ingested to published");
+  ping_to_published_latency.report(status, "ping to published");
+  full_publish_latency.report(status, "full publish");
+  update_publish_latency.report(status, "update publish");
+  status.add("decimation", uint32_t(decimation));
+  status.add("pings shed", uint64_t(pings_shed));
+  status.add("soundings shed", uint64_t(soundings_shed));
+  status.add("pings ingested", uint64_t(pings_ingested));
+  status.add("soundings ingested", soundings);
+  status.add("soundings/s", soundings_rate);
+  status.add("grids", resident.grids);
+  status.add("nodes", resident.nodes);
+  status.add("hypotheses", resident.hypotheses);
+  status.add("resident memory (MiB)", residentMemory()/(1024.0*1024.0));
+  status.add("publish count", uint64_t(publish_count));
+  if(compact_enabled)
+  {
+    uint64_t bytes = compact_bytes;
+    status.add("compact bytes published", bytes);
+    if(bytes > 0)
+      status.add("compact size reduction", double(compact_float_bytes)/bytes);
+  }
+}
+
+/// Apply the private parameters named after cube::Parameters fields,
+/// such as ~iho_order or ~maximum_hypotheses.
+void loadParameters(cube::Parameters& parameters)
+{
+  ros::NodeHandle private_nh("~");
+  for(const auto& name: cube::Parameters::names())
+  {
+    XmlRpc::XmlRpcValue value;
+    if(!private_nh.getParam(name, value))
+      continue;
+    std::stringstream text;
+    text.precision(17);
+    switch(value.getType())
+    {
+      case XmlRpc::XmlRpcValue::TypeBoolean:
+        text << (bool(value) ? "true" : "false");
+        break;
+      case XmlRpc::XmlRpcValue::TypeInt:
+        text << int(value);
+        break;
+      case XmlRpc::XmlRpcValue::TypeDouble:
+        text << double(value);
+        break;
+      case XmlRpc::XmlRpcValue::TypeString:
+        text << std::string(value);
+        break;
+      default:
+        throw std::invalid_argument("Unsupported type for parameter "+name);
+    }
+    parameters.set(name, text.str());
+  }
+  parameters.validate();
 }
 
 int main(int argc, char **argv)
@@ -139,20 +921,88 @@ int main(int argc, char **argv)
 
   map_frame = ros::NodeHandle("~").param("map_frame", map_frame);
 
-  map_sheet = std::make_shared<cube::MapSheet>(cube::CellCounts(50), cube::CellSizes(5.0));
+  double resolution = ros::NodeHandle("~").param("resolution", 5.0);
+  int grid_size = ros::NodeHandle("~").param("grid_size", 50);
+  double grid_memory = ros::NodeHandle("~").param("grid_memory", 4.0);
+  try
+  {
+    cube::CellSizes cell_sizes(resolution);
+    cube::Parameters parameters(cell_sizes);
+    loadParameters(parameters);
+    cube::CellCounts cell_counts(std::max(0, grid_size));
+    if(grid_size <= 0)
+      cell_counts = cube::MapSheet::autoCellCounts(grid_memory*1024*1024, parameters);
+    ROS_INFO_STREAM("resolution: " << resolution << " m, grid size: " << cell_counts.x << " cells, IHO order: " << parameters.iho_order);
+    map_sheet = std::make_shared<cube::MapSheet>(cell_counts, cell_sizes, parameters);
+  }
+  catch(const std::invalid_argument& e)
+  {
+    ROS_FATAL_STREAM(e.what());
+    return 1;
+  }
 
   tfBuffer = std::make_shared<tf2_ros::Buffer>();
   tf2_ros::TransformListener tfListener(*tfBuffer);
 
+  publish_period = ros::Duration(ros::NodeHandle("~").param("publish_period", publish_period.toSec()));
+  full_publish_period = ros::Duration(ros::NodeHandle("~").param("full_publish_period", full_publish_period.toSec()));
+  if(publish_period <= ros::Duration(0.0))
+  {
+    ROS_ERROR_STREAM("~publish_period must be positive, got " << publish_period.toSec() << " s; using 5 s");
+    publish_period = ros::Duration(5.0);
+  }
+  if(full_publish_period <= ros::Duration(0.0))
+  {
+    ROS_ERROR_STREAM("~full_publish_period must be positive, got " << full_publish_period.toSec() << " s; using 60 s");
+    full_publish_period = ros::Duration(60.0);
+  }
+
+  int queue_capacity = ros::NodeHandle("~").param("queue_size", int(ping_queue_capacity));
+  ping_queue_capacity = std::max(1, queue_capacity);
+  tf_timeout = ros::WallDuration(ros::NodeHandle("~").param("tf_timeout", tf_timeout.toSec()));
+  maximum_ingest_lag = ros::Duration(ros::NodeHandle("~").param("max_ingest_lag", maximum_ingest_lag.toSec()));
+
+  extra_layers = ros::NodeHandle("~").param("extra_layers", extra_layers);
+
   grid_publisher = nh.advertise<grid_map_msgs::GridMap>("grid", 10);
+  tile_publisher = nh.advertise<grid_map_msgs::GridMap>("grid_updates", 100);
 
-  auto ping_sub = nh.subscribe("soundings", 10, &pingCallback);
-  // message_filters::Subscriber<sensor_msgs::PointCloud2> ping_sub;
-  // ping_sub.subscribe(nh, "soundings", 10);
-  // tf2_ros::MessageFilter<sensor_msgs::PointCloud2> tf2_filter(ping_sub, *tfBuffer, map_frame, 10, 0);
-  // tf2_filter.registerCallback(&pingCallback);
+  compact_enabled = ros::NodeHandle("~").param("compact", compact_enabled);
+  if(compact_enabled)
+  {
+    bool delta = ros::NodeHandle("~").param("compact_delta", true);
+    int key_interval = ros::NodeHandle("~").param("compact_key_interval", 10);
+    compact_encoder = std::make_shared<cube::CompactTileEncoder>(delta, std::max(0, key_interval));
+    compact_publisher = nh.advertise<cube_bathymetry::CompactSurface>("compact_grid_updates", 10);
+  }
+
+  diagnostic_updater::Updater updater;
+  updater.setHardwareID("none");
+  updater.add("Pipeline", &updateDiagnostics);
+  auto diagnostics_timer = nh.createWallTimer(ros::WallDuration(1.0), [&](const ros::WallTimerEvent&){updater.update();});
+
+  auto ping_sub = nh.subscribe("soundings", ping_queue_capacity, &pingCallback);
+
+  // Queries get their own queue and spinner so they don't wait behind
+  // the subscriber and timer callbacks.
+  maximum_query_nodes = std::max(1, ros::NodeHandle("~").param("max_query_nodes", int(maximum_query_nodes)));
+  maximum_query_area = ros::NodeHandle("~").param("max_query_area", maximum_query_area);
+  ros::CallbackQueue query_queue;
+  ros::NodeHandle query_nh;
+  query_nh.setCallbackQueue(&query_queue);
+  auto point_service = query_nh.advertiseService("query_point", &queryPoint);
+  auto box_service = query_nh.advertiseService("query_box", &queryBox);
+  ros::AsyncSpinner query_spinner(1, &query_queue);
+  query_spinner.start();
+
+  std::thread ingest_thread(&ingestThread);
+  std::thread publish_thread(&publishThread);
 
   ros::spin();
 
+  ping_queue_condition.notify_all();
+  ingest_thread.join();
+  publish_thread.join();
+
   return 0;
 }
@@ -0,0 +1,397 @@
+#include <cube_bathymetry/map_sheet.h>
+#include <cube_bathymetry/simrad_file.h>
+#include <cube_bathymetry/sounding_file.h>
+#ifdef CUBE_HAVE_GSF
+#include <cube_bathymetry/gsf_reader.h>
+#endif
+#ifdef CUBE_HAVE_GDAL
+#include <cube_bathymetry/geotiff_writer.h>
+#include <cube_bathymetry/bag_writer.h>
+#include "ogr_spatialref.h"
+#include "cpl_conv.h"
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Builds a surface from soundings files, without ROS.
+
+/// True if filename ends in extension, ignoring case
+bool hasExtension(const std::string& filename, const std::string& extension)
+{
+  if(filename.size() < extension.size())
+    return false;
+  std::string ending = filename.substr(filename.size() - extension.size());
+  for(auto& c: ending)
+    c = std::tolower(c);
+  return ending == extension;
+}
+
+void usage()
+{
+  std::cout << "usage: cube_surface [options and input files]\n";
+  std::cout << "  Input files are binary soundings files, or ASCII files with lines of\n";
+  std::cout << "  x y depth vertical_error horizontal_error (errors as variances, m^2)\n";
+  std::cout << "  Files ending in .all are read as Kongsberg EM raw files";
+#ifdef CUBE_HAVE_GSF
+  std::cout << ", and files ending in\n  .gsf as GSF";
+#endif
+  std::cout << ". These are positioned in a local projection\n";
+  std::cout << "  centred on the first position in the first of them, and can't be\n";
+  std::cout << "  mixed with soundings files or used with -s\n";
+  std::cout << "  -B 1000: Soundings added to the sheet at a time\n";
+#ifdef CUBE_HAVE_GDAL
+  std::cout << "  -b: Write a BAG (Bathymetric Attributed Grid) instead of a GeoTIFF\n";
+  std::cout << "  -c: Write a cloud optimised GeoTIFF, compressed with internal overviews\n";
+#endif
+  std::cout << "  -g 96: Grid size in cells, rounded up to a multiple of 16, 0 to pick it from the grid memory size\n";
+  std::cout << "  -G 4: Target memory per grid in MiB when choosing the grid size\n";
+  std::cout << "  -H 0: Maximum hypotheses per node, 0 for no limit\n";
+  std::cout << "  -i order1a: IHO order (exclusive, special, order1a, order1b or order2)\n";
+  std::cout << "  -j N: Consecutive .all files decoded at once, one per thread, default the number of cores\n";
+#ifdef CUBE_HAVE_GDAL
+  std::cout << "  -l: Add hypothesis count, hypothesis strength ratio and sample count bands\n";
+  std::cout << "  -o output.tiff: Output file name, no output if not given\n";
+#endif
+  std::cout << "  -p name=value: Set a CUBE parameter, may be repeated\n";
+  std::cout << "  -r 1.0: Resolution in meters\n";
+#ifdef CUBE_HAVE_GDAL
+  std::cout << "  -s EPSG:32619: Spatial reference of the soundings, as WKT, EPSG code or proj string\n";
+#endif
+  std::cout << "  -w soundings.bin: Also write all the input soundings to a binary soundings file\n";
+  exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> arguments(argv+1,argv+argc);
+
+  if (arguments.empty())
+    usage();
+
+  std::vector<std::string> input_filenames;
+  std::string output_filename;
+  std::string binary_filename;
+  std::size_t batch_size = 1000;
+  double resolution = 1.0;
+  uint32_t grid_size = 96;
+  double grid_memory = 4.0;
+  std::string iho_order = "order1a";
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::pair<std::string, std::string> > cube_parameters;
+  std::string spatial_reference;
+#ifdef CUBE_HAVE_GDAL
+  cube::GeoTiffOptions geotiff_options;
+  bool write_bag = false;
+#endif
+
+  try
+  {
+    for (auto arg = arguments.begin(); arg != arguments.end();arg++)
+    {
+      bool has_value = arg+1 != arguments.end();
+      if (*arg == "-h")
+      {
+        usage();
+      }
+      else if (*arg == "-B" && has_value)
+      {
+        batch_size = std::max<std::size_t>(1, std::stoul(*++arg));
+      }
+#ifdef CUBE_HAVE_GDAL
+      else if (*arg == "-b")
+      {
+        write_bag = true;
+      }
+      else if (*arg == "-c")
+      {
+        geotiff_options.cloud_optimised = true;
+      }
+      else if (*arg == "-l")
+      {
+        geotiff_options.extra_layers = true;
+      }
+      else if (*arg == "-o" && has_value)
+      {
+        output_filename = *++arg;
+      }
+      else if (*arg == "-s" && has_value)
+      {
+        spatial_reference = *++arg;
+      }
+#endif
+      else if (*arg == "-g" && has_value)
+      {
+        grid_size = std::stoul(*++arg);
+      }
+      else if (*arg == "-G" && has_value)
+      {
+        grid_memory = std::stod(*++arg);
+      }
+      else if (*arg == "-H" && has_value)
+      {
+        cube_parameters.push_back(std::make_pair("maximum_hypotheses", *++arg));
+      }
+      else if (*arg == "-i" && has_value)
+      {
+        iho_order = *++arg;
+      }
+      else if (*arg == "-j" && has_value)
+      {
+        threads = std::max<std::size_t>(1, std::stoul(*++arg));
+      }
+      else if (*arg == "-p" && has_value)
+      {
+        arg++;
+        auto separator = arg->find('=');
+        if(separator == std::string::npos)
+          usage();
+        cube_parameters.push_back(std::make_pair(arg->substr(0, separator), arg->substr(separator+1)));
+      }
+      else if (*arg == "-r" && has_value)
+      {
+        resolution = std::stod(*++arg);
+      }
+      else if (*arg == "-w" && has_value)
+      {
+        binary_filename = *++arg;
+      }
+      else if (!arg->empty() && (*arg)[0] == '-')
+      {
+        usage();
+      }
+      else
+      {
+        input_filenames.push_back(*arg);
+      }
+    }
+  }
+  catch(const std::logic_error& e)
+  {
+    std::cerr << "Invalid option value: " << e.what() << std::endl;
+    return 1;
+  }
+
+  // Raw and GSF soundings are in the local projection, so they can't be
+  // combined with soundings already in a map frame or given another one
+  std::size_t survey_file_count = std::count_if(input_filenames.begin(), input_filenames.end(), [](const std::string& filename)
+    {
+      return hasExtension(filename, ".all") || hasExtension(filename, ".gsf");
+    });
+  if(survey_file_count > 0 && survey_file_count < input_filenames.size())
+  {
+    std::cerr << "Raw and GSF files can't be mixed with soundings files in one run" << std::endl;
+    return 1;
+  }
+  if(survey_file_count > 0 && !spatial_reference.empty())
+  {
+    std::cerr << "-s can't be used with raw or GSF files, which are positioned in a local projection" << std::endl;
+    return 1;
+  }
+
+  cube::CellSizes cell_sizes(resolution);
+  cube::Parameters parameters(cell_sizes);
+  try
+  {
+    parameters = cube::Parameters(cell_sizes, iho_order);
+    for(const auto& p: cube_parameters)
+      parameters.set(p.first, p.second);
+    parameters.validate();
+  }
+  catch(const std::invalid_argument& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  // Each grid is written as one GeoTIFF tile, which must be a multiple of 16 cells
+  grid_size = (grid_size+15)/16*16;
+  cube::CellCounts grid_cell_counts(grid_size);
+  if(grid_size == 0)
+    grid_cell_counts = cube::MapSheet::autoCellCounts(grid_memory*1024*1024, parameters);
+  std::cout << "resolution: " << resolution << " m, grid size: " << grid_cell_counts.x << " cells" << std::endl;
+
+  cube::MapSheet map_sheet(grid_cell_counts, cell_sizes, parameters);
+
+  std::unique_ptr<cube::SoundingFileWriter> sounding_writer;
+  std::unique_ptr<cube::LocalProjection> local_projection;
+  uint64_t simrad_ping_count = 0;
+  double simrad_seconds = 0.0;
+#ifdef CUBE_HAVE_GSF
+  uint64_t ping_count = 0;
+  double gsf_seconds = 0.0;
+  std::vector<cube::Sounding> ping;
+  std::vector<cube::Sounding> batch;
+#endif
+  uint64_t sounding_count = 0;
+  auto add_soundings = [&](const cube::Sounding* begin, const cube::Sounding* end)
+  {
+    map_sheet.addSoundings(begin, end);
+    sounding_count += end - begin;
+    if(sounding_writer)
+      sounding_writer->write(begin, end);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  try
+  {
+    // Soundings are written as they are read rather than held to the end
+    if(!binary_filename.empty())
+      sounding_writer.reset(new cube::SoundingFileWriter(binary_filename));
+
+    for(std::size_t i = 0; i < input_filenames.size(); i++)
+    {
+      const auto& filename = input_filenames[i];
+      if(hasExtension(filename, ".all"))
+      {
+        // Consecutive raw files are decoded together, each on its own thread
+        std::vector<std::string> simrad_filenames;
+        for(; i < input_filenames.size() && hasExtension(input_filenames[i], ".all"); i++)
+        {
+          std::cout << "reading " << input_filenames[i] << "..." << std::endl;
+          simrad_filenames.push_back(input_filenames[i]);
+        }
+        i--;
+        if(!local_projection)
+        {
+          double latitude, longitude;
+          for(const auto& f: simrad_filenames)
+            if(cube::SimradFile::firstPosition(f, latitude, longitude))
+            {
+              local_projection.reset(new cube::LocalProjection(latitude, longitude));
+              break;
+            }
+          if(!local_projection)
+          {
+            std::string names;
+            for(const auto& f: simrad_filenames)
+              names += (names.empty() ? "" : ", ") + f;
+            throw std::runtime_error("no position datagrams to position the pings in " + names);
+          }
+        }
+        auto simrad_start = std::chrono::steady_clock::now();
+        simrad_ping_count += cube::readSimradFiles(simrad_filenames, *local_projection, cube::SimradReaderOptions(), threads, batch_size, add_soundings);
+        simrad_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - simrad_start).count();
+        continue;
+      }
+
+      std::cout << "reading " << filename << "..." << std::endl;
+      if(cube::MappedSoundingFile::isBinary(filename))
+      {
+        // Soundings go to the sheet straight from the mapping
+        cube::MappedSoundingFile file(filename);
+        for(auto batch = file.begin(); batch != file.end();)
+        {
+          auto batch_end = batch + std::min<std::size_t>(batch_size, file.end() - batch);
+          add_soundings(batch, batch_end);
+          batch = batch_end;
+        }
+      }
+#ifdef CUBE_HAVE_GSF
+      else if(hasExtension(filename, ".gsf"))
+      {
+        if(!local_projection)
+        {
+          double latitude, longitude;
+          if(!cube::GsfReader::firstPosition(filename, latitude, longitude))
+          {
+            std::cerr << "no pings in " << filename << ", skipping it" << std::endl;
+            continue;
+          }
+          local_projection.reset(new cube::LocalProjection(latitude, longitude));
+        }
+        // Pings are decoded ahead while the previous batch is inserted
+        auto gsf_start = std::chrono::steady_clock::now();
+        cube::GsfReader reader(filename, *local_projection);
+        while(reader.next(ping))
+        {
+          batch.insert(batch.end(), ping.begin(), ping.end());
+          if(batch.size() >= batch_size)
+          {
+            add_soundings(batch.data(), batch.data() + batch.size());
+            batch.clear();
+          }
+        }
+        if(!batch.empty())
+          add_soundings(batch.data(), batch.data() + batch.size());
+        batch.clear();
+        ping_count += reader.pingCount();
+        gsf_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - gsf_start).count();
+      }
+#endif
+      else
+        cube::readAsciiSoundings(filename, batch_size, add_soundings);
+    }
+
+    if(sounding_writer)
+      sounding_writer->close();
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << sounding_count << " soundings in " << seconds << " seconds (" << sounding_count/std::max(seconds, 1e-9) << " soundings/s)" << std::endl;
+  if(simrad_ping_count > 0)
+    std::cout << simrad_ping_count << " EM pings in " << simrad_seconds << " seconds (" << simrad_ping_count/std::max(simrad_seconds, 1e-9) << " pings/s)" << std::endl;
+#ifdef CUBE_HAVE_GSF
+  if(ping_count > 0)
+    std::cout << ping_count << " GSF pings in " << gsf_seconds << " seconds (" << ping_count/std::max(gsf_seconds, 1e-9) << " pings/s)" << std::endl;
+#endif
+
+  auto histogram = map_sheet.hypothesisCountHistogram();
+  uint64_t node_count = 0;
+  uint64_t hypothesis_count = 0;
+  for(std::size_t i = 0; i < histogram.size(); i++)
+  {
+    node_count += histogram[i];
+    hypothesis_count += i*histogram[i];
+  }
+  std::cout << map_sheet.grids().size() << " grids, " << node_count << " nodes, " << hypothesis_count << " hypotheses" << std::endl;
+
+#ifdef CUBE_HAVE_GDAL
+  if(output_filename.empty())
+    return 0;
+
+  std::string projection;
+  if(spatial_reference.empty() && local_projection)
+    spatial_reference = local_projection->projString();
+  if(!spatial_reference.empty())
+  {
+    OGRSpatialReference srs;
+    char* wkt = nullptr;
+    if(srs.SetFromUserInput(spatial_reference.c_str()) != OGRERR_NONE || srs.exportToWkt(&wkt) != OGRERR_NONE)
+    {
+      std::cerr << "Unrecognised spatial reference: " << spatial_reference << std::endl;
+      return 1;
+    }
+    projection = wkt;
+    CPLFree(wkt);
+  }
+
+  auto write_start = std::chrono::steady_clock::now();
+  try
+  {
+    if(write_bag)
+      cube::writeBag(map_sheet, output_filename, projection);
+    else
+      cube::writeGeoTiff(map_sheet, output_filename, projection, geotiff_options);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << "Error writing " << output_filename << ": " << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "wrote " << output_filename << " in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - write_start).count() << " seconds" << std::endl;
+#endif
+
+  return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef CUBE_BATHYMETRY_GDAL_UTILITIES_H
+#define CUBE_BATHYMETRY_GDAL_UTILITIES_H
+
+// Helpers shared by the GDAL writers.  Not installed.
+
+#include "gdal_priv.h"
+#include "cpl_conv.h"
+#include "ogr_spatialref.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace cube
+{
+
+struct DatasetCloser
+{
+  void operator()(GDALDataset* dataset) const
+  {
+    GDALClose(GDALDatasetH(dataset));
+  }
+};
+
+typedef std::unique_ptr<GDALDataset, DatasetCloser> DatasetPtr;
+
+inline void check(CPLErr error, const std::string& what)
+{
+  if(error != CE_None)
+    throw std::runtime_error(what + ": " + CPLGetLastErrorMsg());
+}
+
+/// Convert a WKT, EPSG code or proj string to WKT, since the GTiff and
+/// BAG drivers only accept WKT
+inline std::string toWkt(const std::string& projection)
+{
+  OGRSpatialReference srs;
+  char* wkt = nullptr;
+  bool converted = srs.SetFromUserInput(projection.c_str()) == OGRERR_NONE && srs.exportToWkt(&wkt) == OGRERR_NONE;
+  std::string ret = converted ? wkt : "";
+  CPLFree(wkt);
+  if(!converted)
+    throw std::runtime_error("unrecognised projection: " + projection);
+  return ret;
+}
+
+} // namespace cube
+
+#endif
@@ -0,0 +1,232 @@
+#include "cube_bathymetry/geotiff_writer.h"
+#include "gdal_utilities.h"
+#include "cpl_string.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace cube
+{
+
+namespace
+{
+
+/// Fill destination, an overview of half the resolution of source, with
+/// the mean of the non-NaN source pixels under each pixel.  Works through
+/// the destination a chunk at a time so only a small window of each is in
+/// memory.
+void downsample(GDALRasterBand& source, GDALRasterBand& destination)
+{
+  const int chunk = 256;
+  int source_width = source.GetXSize();
+  int source_height = source.GetYSize();
+  int width = destination.GetXSize();
+  int height = destination.GetYSize();
+
+  std::vector<float> in(4*chunk*chunk);
+  std::vector<float> out(chunk*chunk);
+  for(int y = 0; y < height; y += chunk)
+    for(int x = 0; x < width; x += chunk)
+    {
+      int out_width = std::min(chunk, width - x);
+      int out_height = std::min(chunk, height - y);
+      int in_width = std::min(2*out_width, source_width - 2*x);
+      int in_height = std::min(2*out_height, source_height - 2*y);
+      check(source.RasterIO(GF_Read, 2*x, 2*y, in_width, in_height, in.data(), in_width, in_height, GDT_Float32, 0, 0), "reading for overview");
+
+      for(int row = 0; row < out_height; row++)
+        for(int column = 0; column < out_width; column++)
+        {
+          float sum = 0.0;
+          int count = 0;
+          for(int in_row = 2*row; in_row < std::min(2*row+2, in_height); in_row++)
+            for(int in_column = 2*column; in_column < std::min(2*column+2, in_width); in_column++)
+            {
+              float value = in[in_row*in_width+in_column];
+              if(!std::isnan(value))
+              {
+                sum += value;
+                ++count;
+              }
+            }
+          out[row*out_width+column] = count > 0 ? sum/count : std::numeric_limits<float>::quiet_NaN();
+        }
+
+      check(destination.RasterIO(GF_Write, x, y, out_width, out_height, out.data(), out_width, out_height, GDT_Float32, 0, 0), "writing overview");
+    }
+}
+
+/// Add internal overviews to dataset, halving the resolution each time
+/// until an overview fits in a single block, and compute them ourselves so
+/// NaN is treated as missing data.
+void buildOverviews(GDALDataset& dataset, const CellCounts& block_counts)
+{
+  int width = dataset.GetRasterXSize();
+  int height = dataset.GetRasterYSize();
+  std::vector<int> factors;
+  for(int factor = 2; (width+factor/2-1)/(factor/2) > int(block_counts.x) || (height+factor/2-1)/(factor/2) > int(block_counts.y); factor *= 2)
+    factors.push_back(factor);
+  if(factors.empty())
+    return;
+
+  /* Only allocate them, the default resamplers would mix NaN in */
+  check(dataset.BuildOverviews("NONE", int(factors.size()), factors.data(), 0, nullptr, GDALDummyProgress, nullptr), "creating overviews");
+
+  for(int band_number = 1; band_number <= dataset.GetRasterCount(); band_number++)
+  {
+    auto band = dataset.GetRasterBand(band_number);
+    auto source = band;
+    for(int i = 0; i < band->GetOverviewCount(); i++)
+    {
+      auto overview = band->GetOverview(i);
+      downsample(*source, *overview);
+      source = overview;
+    }
+  }
+  /* FlushCache() only returns an error from GDAL 3.7 */
+  CPLErrorReset();
+  dataset.FlushCache();
+  if(CPLGetLastErrorType() >= CE_Failure)
+    throw std::runtime_error(std::string("writing overviews: ") + CPLGetLastErrorMsg());
+}
+
+struct Layer
+{
+  const char* name;
+  float (*value)(const NodeValues&);
+};
+
+const std::vector<Layer>& layers(bool extra_layers)
+{
+  static const std::vector<Layer> all = {
+    {"depth", [](const NodeValues& v) {return v.depth;}},
+    {"uncertainty", [](const NodeValues& v) {return v.uncertainty;}},
+    {"hypothesis_count", [](const NodeValues& v) {return std::isnan(v.depth) ? std::numeric_limits<float>::quiet_NaN() : float(v.hypothesis_count);}},
+    {"hypothesis_strength_ratio", [](const NodeValues& v) {return v.ratio;}},
+    {"sample_count", [](const NodeValues& v) {return std::isnan(v.depth) ? std::numeric_limits<float>::quiet_NaN() : float(v.sample_count);}}
+  };
+  static const std::vector<Layer> surface(all.begin(), all.begin()+2);
+  return extra_layers ? all : surface;
+}
+
+/// Deletes a dataset file when it goes out of scope, so the intermediate
+/// file of a cloud optimised GeoTIFF isn't left behind when writing it
+/// fails.  Declare it before the dataset so the dataset is closed first.
+struct TemporaryFile
+{
+  GDALDriver* driver = nullptr;
+  std::string filename;
+
+  ~TemporaryFile()
+  {
+    if(driver)
+      driver->Delete(filename.c_str());
+  }
+};
+
+} // namespace
+
+void writeGeoTiff(const MapSheet& sheet, const std::string& filename, const std::string& projection, const GeoTiffOptions& geotiff_options)
+{
+  auto counts = sheet.cellCountsPerGrid();
+  if(counts.x % 16 != 0 || counts.y % 16 != 0)
+    throw std::invalid_argument("grid cell counts must be a multiple of 16 to be written as GeoTIFF tiles");
+
+  auto total_counts = sheet.totalCellCounts();
+  auto bounds = sheet.gridBounds();
+  auto sizes = sheet.cellSizes();
+
+  GDALAllRegister();
+  auto driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+  if(!driver)
+    throw std::runtime_error("GDAL GTiff driver not available");
+
+  /* Band interleaving lets each band's tile be written on its own,
+   * without GDAL caching the other band's copy of it.
+   */
+  char** options = nullptr;
+  options = CSLSetNameValue(options, "TILED", "YES");
+  options = CSLSetNameValue(options, "BLOCKXSIZE", std::to_string(counts.x).c_str());
+  options = CSLSetNameValue(options, "BLOCKYSIZE", std::to_string(counts.y).c_str());
+  options = CSLSetNameValue(options, "INTERLEAVE", "BAND");
+  options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+  const auto& band_layers = layers(geotiff_options.extra_layers);
+  auto tiles_filename = geotiff_options.cloud_optimised ? filename + ".tmp" : filename;
+  TemporaryFile temporary;
+  DatasetPtr dataset(driver->Create(tiles_filename.c_str(), total_counts.x, total_counts.y, band_layers.size(), GDT_Float32, options));
+  CSLDestroy(options);
+  if(!dataset)
+    throw std::runtime_error("unable to create " + tiles_filename + ": " + CPLGetLastErrorMsg());
+  if(geotiff_options.cloud_optimised)
+  {
+    temporary.driver = driver;
+    temporary.filename = tiles_filename;
+  }
+
+  double geo_transform[6] = {bounds.minimum.x - sizes.x/2.0, sizes.x, 0, bounds.maximum.y - sizes.y/2.0, 0, -sizes.y};
+  check(dataset->SetGeoTransform(geo_transform), "setting geotransform");
+  check(dataset->SetProjection(toWkt(projection).c_str()), "setting projection");
+
+  std::vector<GDALRasterBand*> bands;
+  for(const auto& layer: band_layers)
+  {
+    bands.push_back(dataset->GetRasterBand(bands.size()+1));
+    bands.back()->SetDescription(layer.name);
+    check(bands.back()->SetNoDataValue(std::numeric_limits<double>::quiet_NaN()), std::string("setting ") + layer.name + " nodata");
+  }
+
+  auto grid_sizes = sizes*counts;
+  std::vector<float> tile(counts.x*counts.y);
+  for(auto grid: sheet.grids())
+  {
+    int block_x = std::lround((grid->origin().x - bounds.minimum.x)/grid_sizes.x);
+    int block_y = std::lround((bounds.maximum.y - grid->origin().y)/grid_sizes.y) - 1;
+
+    /* All the layers come from one pass over the nodes.  Grid rows run
+     * north from the origin, tile rows run south.
+     */
+    auto values = grid->nodeValues();
+    for(std::size_t b = 0; b < bands.size(); b++)
+    {
+      auto value = band_layers[b].value;
+      for(uint32_t row = 0; row < counts.y; row++)
+      {
+        auto source = values.begin() + (counts.y - 1 - row)*counts.x;
+        for(uint32_t column = 0; column < counts.x; column++, source++)
+          tile[row*counts.x+column] = value(*source);
+      }
+      check(bands[b]->WriteBlock(block_x, block_y, tile.data()), std::string("writing ") + band_layers[b].name);
+    }
+  }
+
+  if(!geotiff_options.cloud_optimised)
+  {
+    /* Closing writes the tiles of missing grids, filled with nodata */
+    dataset.reset();
+    return;
+  }
+
+  buildOverviews(*dataset, counts);
+
+  /* Copying the overviews puts them, and the tile offsets, ahead of the
+   * full resolution tiles as the cloud optimised layout requires.  The
+   * COG driver does the same but needs GDAL 3.1.
+   */
+  options = nullptr;
+  options = CSLSetNameValue(options, "TILED", "YES");
+  options = CSLSetNameValue(options, "BLOCKXSIZE", std::to_string(counts.x).c_str());
+  options = CSLSetNameValue(options, "BLOCKYSIZE", std::to_string(counts.y).c_str());
+  options = CSLSetNameValue(options, "INTERLEAVE", "BAND");
+  options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+  options = CSLSetNameValue(options, "COPY_SRC_OVERVIEWS", "YES");
+  options = CSLSetNameValue(options, "COMPRESS", geotiff_options.compression.c_str());
+  if(geotiff_options.compression == "DEFLATE" || geotiff_options.compression == "LZW" || geotiff_options.compression == "ZSTD")
+    options = CSLSetNameValue(options, "PREDICTOR", "3");
+  DatasetPtr copy(driver->CreateCopy(filename.c_str(), dataset.get(), false, options, GDALDummyProgress, nullptr));
+  CSLDestroy(options);
+  if(!copy)
+    throw std::runtime_error("unable to create " + filename + ": " + CPLGetLastErrorMsg());
+  copy.reset();
+}
+
+} // namespace cube
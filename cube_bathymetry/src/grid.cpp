@@ -1,5 +1,6 @@
 #include "cube_bathymetry/grid.h"
 #include <cmath>
+#include <algorithm>
 
 namespace cube
 {
@@ -11,10 +12,15 @@ Grid::Grid(CellCounts counts, CellSizes sizes, MapPosition origin, const Paramet
 }
 
 bool Grid::insert(const std::vector<Sounding> & soundings)
+{
+  return insert(soundings.data(), soundings.data()+soundings.size());
+}
+
+bool Grid::insert(const Sounding* begin, const Sounding* end)
 {
   bool ret = false;
-  for(const auto &s: soundings)
-    ret = insert(s) || ret;
+  for(auto s = begin; s != end; ++s)
+    ret = insert(*s) || ret;
   return ret;
 }
 
@@ -114,10 +120,56 @@ std::vector<DepthAndUncertainty > Grid::values() const
   return ret;
 }
 
+std::vector<NodeValues> Grid::nodeValues() const
+{
+  std::vector<NodeValues> ret(nodes_.size());
+  for(std::size_t i = 0; i < nodes_.size(); i++)
+    if(nodes_[i])
+    {
+      nodes_[i]->queueFlush(parameters_);
+      ret[i] = nodes_[i]->extractValues(parameters_);
+    }
+  return ret;
+}
+
+void Grid::hypothesisCountHistogram(std::vector<uint64_t> &histogram) const
+{
+  for(const auto& node: nodes_)
+    if(node)
+    {
+      auto count = node->hypothesisCount();
+      if(histogram.size() <= count)
+        histogram.resize(count+1, 0);
+      ++histogram[count];
+    }
+}
+
 MapBounds Grid::bounds() const
 {
   return MapBounds(origin_, origin_+(sizes_*counts_));
 }
 
+std::shared_ptr<Node> Grid::node(const CellIndex& index) const
+{
+  if(index.x < 0 || index.y < 0 || index.x >= int32_t(counts_.x) || index.y >= int32_t(counts_.y))
+    return nullptr;
+  return nodes_[index.y*counts_.x+index.x];
+}
+
+uint64_t Grid::lastUpdate() const
+{
+  return last_update_;
+}
+
+std::chrono::steady_clock::time_point Grid::lastUpdateTime() const
+{
+  return last_update_time_;
+}
+
+void Grid::setLastUpdate(uint64_t update, std::chrono::steady_clock::time_point time)
+{
+  last_update_ = update;
+  last_update_time_ = std::max(last_update_time_, time);
+}
 
 } // namespace cube
@@ -0,0 +1,257 @@
+#include "cube_bathymetry/gsf_reader.h"
+#include "gsf.h"
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifndef GSF_NULL_DEPTH
+#define GSF_NULL_DEPTH 0.0
+#endif
+
+namespace cube
+{
+
+namespace
+{
+
+constexpr double DEGREES_TO_RADIANS = M_PI/180.0;
+
+/// An open GSF file and the record libgsf decodes into.  libgsf keeps
+/// the beam arrays of the record between reads, only growing them when a
+/// ping has more beams than any before it.
+struct GsfFile
+{
+  std::string filename;
+  int handle;
+  gsfRecords records;
+
+  explicit GsfFile(const std::string& filename)
+    :filename(filename)
+  {
+    std::memset(&records, 0, sizeof(records));
+    if(gsfOpen(filename.c_str(), GSF_READONLY, &handle) != 0)
+      throw std::runtime_error("Unable to open " + filename + ": " + gsfStringError());
+  }
+
+  ~GsfFile()
+  {
+    gsfFree(&records);
+    gsfClose(handle);
+  }
+
+  GsfFile(const GsfFile&) = delete;
+  GsfFile& operator=(const GsfFile&) = delete;
+
+  /// Read up to the next swath bathymetry ping, returning false at the
+  /// end of the file
+  bool readPing()
+  {
+    gsfDataID id;
+    while(true)
+    {
+      int bytes_read = gsfRead(handle, GSF_NEXT_RECORD, &id, &records, nullptr, 0);
+      if(bytes_read < 0)
+      {
+        if(gsfError == GSF_READ_TO_END_OF_FILE)
+          return false;
+        throw std::runtime_error("Error reading " + filename + ": " + gsfStringError());
+      }
+      if(bytes_read == 0)
+        return false;
+      if(id.recordID == GSF_RECORD_SWATH_BATHYMETRY_PING)
+        return true;
+    }
+  }
+
+  /// True if the ping just read is usable
+  bool pingValid() const
+  {
+    const auto& ping = records.mb_ping;
+    return !(ping.ping_flags & GSF_IGNORE_PING) && ping.depth != nullptr &&
+      (ping.latitude != 0.0 || ping.longitude != 0.0);
+  }
+};
+
+} // namespace
+
+struct GsfReader::State
+{
+  GsfFile file;
+  LocalProjection projection;
+  GsfReaderOptions options;
+
+  /// Ring of decoded pings.  The reader thread fills the slot after the
+  /// last ready one, the consumer swaps out the first ready one.
+  std::vector<std::vector<Sounding> > slots;
+  std::size_t first = 0;
+  std::size_t ready = 0;
+  bool done = false;
+  bool stop = false;
+  std::exception_ptr error;
+
+  /// Ping records read, including those without soundings
+  std::atomic<uint64_t> ping_count{0};
+
+  std::mutex mutex;
+  std::condition_variable slot_ready;
+  std::condition_variable slot_free;
+  std::thread thread;
+
+  State(const std::string& filename, const LocalProjection& projection, const GsfReaderOptions& options)
+    :file(filename), projection(projection), options(options), slots(std::max<std::size_t>(1, options.read_ahead))
+  {
+
+  }
+
+  void read();
+  bool decodeNext(std::vector<Sounding>& soundings);
+  void decode(std::vector<Sounding>& soundings) const;
+};
+
+void GsfReader::State::read()
+{
+  try
+  {
+    while(true)
+    {
+      std::size_t slot;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_free.wait(lock, [this]{return stop || ready < slots.size();});
+        if(stop)
+          return;
+        slot = (first + ready)%slots.size();
+      }
+      // The consumer only touches ready slots, so this one is ours
+      if(!decodeNext(slots[slot]))
+        break;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready++;
+      }
+      slot_ready.notify_one();
+    }
+  }
+  catch(...)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  slot_ready.notify_one();
+}
+
+bool GsfReader::State::decodeNext(std::vector<Sounding>& soundings)
+{
+  do
+  {
+    if(!file.readPing())
+      return false;
+    ++ping_count;
+    decode(soundings);
+  }
+  while(soundings.empty());
+  return true;
+}
+
+void GsfReader::State::decode(std::vector<Sounding>& soundings) const
+{
+  soundings.clear();
+  if(!file.pingValid())
+    return;
+
+  const auto& ping = file.records.mb_ping;
+  auto transducer = projection.project(ping.latitude, ping.longitude);
+  double sin_heading = std::sin(ping.heading*DEGREES_TO_RADIANS);
+  double cos_heading = std::cos(ping.heading*DEGREES_TO_RADIANS);
+  float vertical_variance = options.vertical_error*options.vertical_error;
+  float horizontal_variance = options.horizontal_error*options.horizontal_error;
+
+  soundings.reserve(ping.number_beams);
+  for(int beam = 0; beam < ping.number_beams; beam++)
+  {
+    if(ping.depth[beam] == GSF_NULL_DEPTH || (ping.beam_flags && (ping.beam_flags[beam] & GSF_IGNORE_BEAM)))
+      continue;
+
+    /* Along track is forward and across track to starboard, with
+     * heading clockwise from north.
+     */
+    double along = ping.along_track ? ping.along_track[beam] : 0.0;
+    double across = ping.across_track ? ping.across_track[beam] : 0.0;
+    Sounding s;
+    s.x = transducer.x + along*sin_heading + across*cos_heading;
+    s.y = transducer.y + along*cos_heading - across*sin_heading;
+    s.depth = ping.depth[beam];
+    if(ping.vertical_error)
+      s.vertical_error = std::pow(ping.vertical_error[beam]/CONF_95PC, 2);
+    else
+      s.vertical_error = vertical_variance;
+    if(ping.horizontal_error)
+      s.horizontal_error = std::pow(ping.horizontal_error[beam]/CONF_95PC, 2);
+    else
+      s.horizontal_error = horizontal_variance;
+    soundings.push_back(s);
+  }
+}
+
+GsfReader::GsfReader(const std::string& filename, const LocalProjection& projection, const GsfReaderOptions& options)
+  :state_(new State(filename, projection, options))
+{
+  state_->thread = std::thread(&State::read, state_.get());
+}
+
+GsfReader::~GsfReader()
+{
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->stop = true;
+  }
+  state_->slot_free.notify_one();
+  state_->thread.join();
+}
+
+bool GsfReader::next(std::vector<Sounding>& ping)
+{
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  state_->slot_ready.wait(lock, [this]{return state_->ready > 0 || state_->done;});
+  if(state_->ready == 0)
+  {
+    if(state_->error)
+      std::rethrow_exception(state_->error);
+    return false;
+  }
+  ping.swap(state_->slots[state_->first]);
+  state_->first = (state_->first + 1)%state_->slots.size();
+  state_->ready--;
+  lock.unlock();
+  state_->slot_free.notify_one();
+  return true;
+}
+
+uint64_t GsfReader::pingCount() const
+{
+  return state_->ping_count;
+}
+
+bool GsfReader::firstPosition(const std::string& filename, double& latitude, double& longitude)
+{
+  GsfFile file(filename);
+  while(file.readPing())
+    if(file.pingValid())
+    {
+      latitude = file.records.mb_ping.latitude;
+      longitude = file.records.mb_ping.longitude;
+      return true;
+    }
+  return false;
+}
+
+} // namespace cube
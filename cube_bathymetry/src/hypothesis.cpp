@@ -5,7 +5,8 @@
 namespace cube
 {
 
-Hypothesis::Hypothesis(float  initial_mean, float initial_variance)
+template <typename StorageT>
+BasicHypothesis<StorageT>::BasicHypothesis(float  initial_mean, float initial_variance)
   :current_estimate(initial_mean), current_variance(initial_variance),
   predicted_estimate(initial_mean), predicted_variance(initial_variance),
   number_of_samples(1)
@@ -13,31 +14,35 @@ Hypothesis::Hypothesis(float  initial_mean, float initial_variance)
 
 }
 
-std::shared_ptr<Hypothesis> Hypothesis::generateNullHypothesis(float depth, float variance)
+template <typename StorageT>
+std::shared_ptr<BasicHypothesis<StorageT> > BasicHypothesis<StorageT>::generateNullHypothesis(float depth, float variance)
 {
-  auto h = std::make_shared<Hypothesis>(depth, variance);
+  auto h = std::make_shared<BasicHypothesis>(depth, variance);
   h->number_of_samples = 0;
   return h;
 }
 
-void Hypothesis::resetMonitor()
+template <typename StorageT>
+void BasicHypothesis<StorageT>::resetMonitor()
 {
   cumulative_bayes_factor = 1.0;
   sequence_length = 0;
 }
 
-bool Hypothesis::monitor(float depth, float variance, const Parameters& parameters)
+template <typename StorageT>
+bool BasicHypothesis<StorageT>::monitor(float depth, float variance, const Parameters& parameters)
 {
-  double forecast_variance = predicted_variance + variance;
-  double error = std::abs(depth - predicted_estimate)/std::sqrt(forecast_variance);
+  double forecast_variance = double(predicted_variance) + variance;
+  double error = std::abs(depth - double(predicted_estimate))/std::sqrt(forecast_variance);
+  float estimate_offset = parameters.estimateOffset();
   double bayes_factor;
   if (error >= 0.0)
-    bayes_factor = exp(0.5*(parameters.estimate_offset*parameters.estimate_offset - 2.0*parameters.estimate_offset*error));
+    bayes_factor = exp(0.5*(estimate_offset*estimate_offset - 2.0*estimate_offset*error));
   else
-    bayes_factor = exp(0.5*(parameters.estimate_offset*parameters.estimate_offset + 2.0*parameters.estimate_offset*error));
+    bayes_factor = exp(0.5*(estimate_offset*estimate_offset + 2.0*estimate_offset*error));
   
   /* Check for single component failure */
-  if (bayes_factor < parameters.bayes_factor_threshold)
+  if (bayes_factor < parameters.bayesFactorThreshold())
   {
     /* This is a potential outlier.  Indicate potential failure. */
     return false;
@@ -48,10 +53,10 @@ bool Hypothesis::monitor(float depth, float variance, const Parameters& paramete
     ++sequence_length;
   else
     sequence_length = 1;
-  cumulative_bayes_factor = bayes_factor * std::min(1.0, cumulative_bayes_factor);
+  cumulative_bayes_factor = bayes_factor * std::min(1.0, double(cumulative_bayes_factor));
 
   /* Check for consequtive failure errors */
-  if (cumulative_bayes_factor < parameters.bayes_factor_threshold || sequence_length > parameters.runlength_threshold)
+  if (cumulative_bayes_factor < parameters.bayesFactorThreshold() || sequence_length > parameters.runlength_threshold)
   {
     /* Indicate intervention required */
     return false;
@@ -61,13 +66,50 @@ bool Hypothesis::monitor(float depth, float variance, const Parameters& paramete
   return true;
 }
 
-bool Hypothesis::update(float depth, float variance, const Parameters& parameters)
+template <typename StorageT>
+bool BasicHypothesis<StorageT>::monitorLogDomain(float depth, float variance, const Parameters& parameters)
+{
+  double forecast_variance = double(predicted_variance) + variance;
+  double error = std::abs(depth - double(predicted_estimate))/std::sqrt(forecast_variance);
+
+  /* log of the Bayes factor computed in monitor() */
+  double log_bayes_factor = parameters.logBayesFactorOffset() - parameters.estimateOffset()*error;
+
+  /* Check for single component failure */
+  if (log_bayes_factor < parameters.logBayesFactorThreshold())
+    return false;
+
+  /* Update monitors.  cumulative_bayes_factor holds the log here, and
+   * its reset value of 1 is, like 0, not a failing run.
+   */
+  if (cumulative_bayes_factor < 0.0)
+    ++sequence_length;
+  else
+    sequence_length = 1;
+  cumulative_bayes_factor = log_bayes_factor + std::min(0.0, double(cumulative_bayes_factor));
+
+  /* Check for consequtive failure errors */
+  if (cumulative_bayes_factor < parameters.logBayesFactorThreshold() || sequence_length > parameters.runlength_threshold)
+    return false;
+
+  return true;
+}
+
+template <typename StorageT>
+bool BasicHypothesis<StorageT>::update(float depth, float variance, const Parameters& parameters)
 {
   /* Check current estimate with monitoring */
-  if (!monitor(depth, variance, parameters))
+  bool supported = parameters.log_domain_monitoring ? monitorLogDomain(depth, variance, parameters) : monitor(depth, variance, parameters);
+  if (!supported)
     return false;
 
-  /* Otherwise, update current hypothesis with new information */
+  /* Otherwise, update current hypothesis with new information.  The
+   * state is loaded into double precision whatever the storage type.
+   */
+  double current_estimate = this->current_estimate;
+  double current_variance = this->current_variance;
+  double predicted_estimate = this->predicted_estimate;
+  double predicted_variance = this->predicted_variance;
 
   input_sample_variance = ((number_of_samples + 1 - 2)*input_sample_variance/(number_of_samples + 1 - 1) + (depth - current_estimate)*(depth - current_estimate)/double(number_of_samples));
 
@@ -80,10 +122,17 @@ bool Hypothesis::update(float depth, float variance, const Parameters& parameter
   current_variance = variance*predicted_variance/(variance+predicted_variance);
   predicted_variance = current_variance + system_variance;
 
+  this->current_estimate = current_estimate;
+  this->current_variance = current_variance;
+  this->predicted_estimate = predicted_estimate;
+  this->predicted_variance = predicted_variance;
+
   ++number_of_samples;
 
   return true;
 }
 
+template struct BasicHypothesis<float>;
+template struct BasicHypothesis<double>;
 
 } // namespace cube
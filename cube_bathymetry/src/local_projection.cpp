@@ -0,0 +1,39 @@
+#include "cube_bathymetry/local_projection.h"
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace cube
+{
+
+namespace
+{
+
+/// Mean radius of the earth (m), as used by proj's +R
+constexpr double EARTH_RADIUS = 6371008.8;
+
+constexpr double DEGREES_TO_RADIANS = M_PI/180.0;
+
+} // namespace
+
+LocalProjection::LocalProjection(double latitude, double longitude)
+  :latitude_(latitude), longitude_(longitude), cos_latitude_(std::cos(latitude*DEGREES_TO_RADIANS))
+{
+
+}
+
+MapPosition LocalProjection::project(double latitude, double longitude) const
+{
+  /* Take the short way round if the sheet spans the antimeridian */
+  double delta_longitude = std::remainder(longitude - longitude_, 360.0);
+  return MapPosition(EARTH_RADIUS*cos_latitude_*delta_longitude*DEGREES_TO_RADIANS, EARTH_RADIUS*(latitude - latitude_)*DEGREES_TO_RADIANS);
+}
+
+std::string LocalProjection::projString() const
+{
+  std::stringstream ret;
+  ret << std::setprecision(12) << "+proj=eqc +lat_ts=" << latitude_ << " +lat_0=" << latitude_ << " +lon_0=" << longitude_ << " +R=" << EARTH_RADIUS << " +units=m +no_defs";
+  return ret.str();
+}
+
+} // namespace cube
@@ -1,5 +1,6 @@
 #include "cube_bathymetry/map_sheet.h"
 #include <cmath>
+#include <algorithm>
 #include <iostream>
 
 namespace cube
@@ -11,6 +12,30 @@ MapSheet::MapSheet(CellCounts counts, CellSizes sizes, std::string iho_order)
 
 }
 
+MapSheet::MapSheet(CellCounts counts, CellSizes sizes, const Parameters& parameters)
+  :counts_(counts), sizes_(sizes), parameters_(parameters)
+{
+
+}
+
+CellCounts MapSheet::autoCellCounts(std::size_t tile_bytes, const Parameters& parameters)
+{
+  /* A populated cell holds a pointer to its node, the node itself with
+   * its shared_ptr control block, a full median queue and one hypothesis.
+   */
+  std::size_t cell_bytes = sizeof(std::shared_ptr<Node>) + sizeof(Node) + 2*sizeof(void*)
+    + parameters.median_length*sizeof(DepthAndUncertainty) + sizeof(Hypothesis);
+
+  uint32_t side = std::sqrt(double(tile_bytes)/cell_bytes);
+
+  /* maximum_context_search_range is in cells, derived from the resolution */
+  uint32_t context_side = std::ceil(parameters.maximum_context_search_range);
+  side = std::max(side, context_side);
+
+  side = std::max<uint32_t>(16, (side+15)/16*16);
+  return CellCounts(side, side);
+}
+
 const CellSizes & MapSheet::cellSizes() const
 {
   return sizes_;
@@ -24,17 +49,27 @@ const CellCounts& MapSheet::cellCountsPerGrid() const
 
 void MapSheet::addSoundings(const std::vector<Sounding> & soundings, std::chrono::steady_clock::time_point time)
 {
-  if(soundings.empty())
+  addSoundings(soundings.data(), soundings.data()+soundings.size(), time);
+}
+
+void MapSheet::addSoundings(const Sounding* begin, const Sounding* end, std::chrono::steady_clock::time_point time)
+{
+  if(begin == end)
     return;
 
   MapBounds bounds;
-  for(const auto &s: soundings)
-    bounds.expand(s);
+  for(auto s = begin; s != end; ++s)
+    bounds.expand(*s);
 
   auto grids = getOrCreateGridsIn(bounds);
+  auto update = update_count_ + 1;
   for(auto g: grids)
-    if(g->insert(soundings));
-      last_update_time_ = time;
+    if(g->insert(begin, end))
+    {
+      g->setLastUpdate(update, time);
+      update_count_ = update;
+      last_update_time_ = std::max(last_update_time_, time);
+    }
 }
 
 std::vector<std::shared_ptr<Grid> > MapSheet::getOrCreateGridsIn(const MapBounds& bounds)
@@ -49,12 +84,13 @@ std::vector<std::shared_ptr<Grid> > MapSheet::getOrCreateGridsIn(const MapBounds
     for(int col = min_index.x; col <= max_index.x; col++)
     {
       GridIndex index(col,row);
-      if(!grids_[index])
+      auto& grid = grids_[index];
+      if(!grid)
       {
         auto origin = sizes_*counts_*index;
-        grids_[index] = std::make_shared<Grid>(counts_, sizes_, origin, parameters_);
+        grid = std::make_shared<Grid>(counts_, sizes_, origin, parameters_);
       }
-      ret.push_back(grids_[index]);
+      ret.push_back(grid);
     }
   return ret;
 
@@ -62,13 +98,140 @@ std::vector<std::shared_ptr<Grid> > MapSheet::getOrCreateGridsIn(const MapBounds
 
 std::vector<std::shared_ptr<Grid> > MapSheet::grids() const
 {
-  std::vector<std::shared_ptr<Grid> > ret;
-  for(const auto g: grids_)
+  /* grids_ is unordered, so return the grids in index order */
+  std::map<GridIndex, std::shared_ptr<Grid> > ordered;
+  for(const auto& g: grids_)
     if(g.second)
-      ret.push_back(g.second);
+      ordered.insert(g);
+  std::vector<std::shared_ptr<Grid> > ret;
+  for(const auto& g: ordered)
+    ret.push_back(g.second);
+  return ret;
+}
+
+uint64_t MapSheet::updateCount() const
+{
+  return update_count_;
+}
+
+std::map<GridIndex, std::shared_ptr<Grid> > MapSheet::gridsUpdatedSince(uint64_t update) const
+{
+  std::map<GridIndex, std::shared_ptr<Grid> > ret;
+  for(const auto& g: grids_)
+    if(g.second && g.second->lastUpdate() > update)
+      ret[g.first] = g.second;
+  return ret;
+}
+
+namespace
+{
+
+/// Floor division, rounding towards negative infinity
+int64_t floorDivide(int64_t numerator, int64_t denominator)
+{
+  auto ret = numerator/denominator;
+  if(numerator % denominator != 0 && (numerator < 0) != (denominator < 0))
+    --ret;
   return ret;
 }
 
+} // namespace
+
+bool MapSheet::queryNode(const MapPosition& position, NodeQuery& result) const
+{
+  if(!valid(position))
+    return false;
+  return queryNode(std::llround(position.x/sizes_.x), std::llround(position.y/sizes_.y), result);
+}
+
+bool MapSheet::queryNode(int64_t column, int64_t row, NodeQuery& result) const
+{
+  GridIndex grid_index(floorDivide(column, counts_.x), floorDivide(row, counts_.y));
+  auto grid = grids_.find(grid_index);
+  if(grid == grids_.end() || !grid->second)
+    return false;
+
+  CellIndex cell_index(column - int64_t(grid_index.x)*counts_.x, row - int64_t(grid_index.y)*counts_.y);
+  return queryNode(*grid->second, cell_index, result);
+}
+
+bool MapSheet::queryNode(const Grid& grid, const CellIndex& cell_index, NodeQuery& result) const
+{
+  auto node = grid.node(cell_index);
+  if(!node)
+    return false;
+
+  result.position = MapPosition(grid.origin().x + cell_index.x*sizes_.x, grid.origin().y + cell_index.y*sizes_.y);
+  result.estimate = node->extractDepthAndUncertainty(parameters_);
+  result.hypotheses.clear();
+  result.nominated = node->enumerateHypotheses(parameters_, result.hypotheses);
+  result.queued = node->queuedCount();
+  return true;
+}
+
+bool MapSheet::queryNodes(const MapBounds& bounds, std::size_t maximum_nodes, std::vector<NodeQuery>& results) const
+{
+  if(!valid(bounds))
+    return true;
+
+  int64_t minimum_column = std::ceil(bounds.minimum.x/sizes_.x);
+  int64_t maximum_column = std::floor(bounds.maximum.x/sizes_.x);
+  int64_t minimum_row = std::ceil(bounds.minimum.y/sizes_.y);
+  int64_t maximum_row = std::floor(bounds.maximum.y/sizes_.y);
+  if(minimum_column > maximum_column || minimum_row > maximum_row)
+    return true;
+
+  /* Only visit the grids overlapping the bounds, looking each one up or
+   * scanning the sheet, whichever is fewer, so a large box over a sparse
+   * sheet costs no more than the grids it covers.
+   */
+  GridIndex minimum_grid(floorDivide(minimum_column, counts_.x), floorDivide(minimum_row, counts_.y));
+  GridIndex maximum_grid(floorDivide(maximum_column, counts_.x), floorDivide(maximum_row, counts_.y));
+  std::vector<std::pair<GridIndex, const Grid*> > overlapping;
+  if((double(maximum_grid.x) - minimum_grid.x + 1)*(double(maximum_grid.y) - minimum_grid.y + 1) <= grids_.size())
+  {
+    for(auto y = minimum_grid.y; y <= maximum_grid.y; y++)
+      for(auto x = minimum_grid.x; x <= maximum_grid.x; x++)
+      {
+        auto grid = grids_.find(GridIndex(x, y));
+        if(grid != grids_.end() && grid->second)
+          overlapping.emplace_back(grid->first, grid->second.get());
+      }
+  }
+  else
+  {
+    for(const auto& g: grids_)
+      if(g.second && g.first.x >= minimum_grid.x && g.first.x <= maximum_grid.x && g.first.y >= minimum_grid.y && g.first.y <= maximum_grid.y)
+        overlapping.emplace_back(g.first, g.second.get());
+    std::sort(overlapping.begin(), overlapping.end(), [](const std::pair<GridIndex, const Grid*>& a, const std::pair<GridIndex, const Grid*>& b)
+      {
+        return a.first.y < b.first.y || (a.first.y == b.first.y && a.first.x < b.first.x);
+      });
+  }
+
+  std::size_t found = 0;
+  NodeQuery result;
+  for(const auto& g: overlapping)
+  {
+    // Clip the bounds to the grid's cells
+    int64_t first_column = int64_t(g.first.x)*counts_.x;
+    int64_t first_row = int64_t(g.first.y)*counts_.y;
+    auto minimum_x = std::max<int64_t>(minimum_column - first_column, 0);
+    auto maximum_x = std::min<int64_t>(maximum_column - first_column, counts_.x - 1);
+    auto minimum_y = std::max<int64_t>(minimum_row - first_row, 0);
+    auto maximum_y = std::min<int64_t>(maximum_row - first_row, counts_.y - 1);
+    for(auto y = minimum_y; y <= maximum_y; y++)
+      for(auto x = minimum_x; x <= maximum_x; x++)
+        if(queryNode(*g.second, CellIndex(x, y), result))
+        {
+          if(found == maximum_nodes)
+            return false;
+          results.push_back(result);
+          ++found;
+        }
+  }
+  return true;
+}
 
 CellCounts MapSheet::totalCellCounts() const
 {
@@ -89,6 +252,25 @@ MapBounds MapSheet::gridBounds() const
   return ret;
 }
 
+std::vector<uint64_t> MapSheet::hypothesisCountHistogram() const
+{
+  std::vector<uint64_t> ret;
+  for(const auto& g: grids_)
+    if(g.second)
+      g.second->hypothesisCountHistogram(ret);
+  return ret;
+}
+
+Parameters& MapSheet::parameters()
+{
+  return parameters_;
+}
+
+const Parameters& MapSheet::parameters() const
+{
+  return parameters_;
+}
+
 GridIndex MapSheet::gridIndex(const MapPosition &position) const
 {
   return floorDivide(position, sizes_*counts_);
@@ -1,17 +1,150 @@
 #include "cube_bathymetry/node.h"
 #include <cmath>
+#include <algorithm>
 
 namespace cube
 {
 
 bool Node::addHypothesis(float depth, float variance)
 {
-  auto new_hypothesis = std::make_shared<Hypothesis>(depth, variance);
-  new_hypothesis->hypothesis_number = depth_hypotheses_.size();
-  depth_hypotheses_.push_back(new_hypothesis);
+  if(!inline_hypothesis_valid_ && depth_hypotheses_.empty())
+  {
+    inline_hypothesis_ = Hypothesis(depth, variance);
+    inline_hypothesis_valid_ = true;
+    return true;
+  }
+
+  generaliseHypotheses();
+  depth_hypotheses_.emplace_back(depth, variance);
+  depth_hypotheses_.back().hypothesis_number = depth_hypotheses_.size()-1;
   return true;
 }
 
+void Node::generaliseHypotheses()
+{
+  if(!inline_hypothesis_valid_)
+    return;
+  depth_hypotheses_.reserve(2);
+  depth_hypotheses_.push_back(inline_hypothesis_);
+  inline_hypothesis_valid_ = false;
+}
+
+Hypothesis* Node::hypotheses()
+{
+  if(inline_hypothesis_valid_)
+    return &inline_hypothesis_;
+  return depth_hypotheses_.data();
+}
+
+const Hypothesis* Node::hypotheses() const
+{
+  if(inline_hypothesis_valid_)
+    return &inline_hypothesis_;
+  return depth_hypotheses_.data();
+}
+
+void Node::limitHypotheses(const Parameters& parameters)
+{
+  if(parameters.maximum_hypotheses == 0)
+    return;
+
+  if(inline_hypothesis_valid_)
+  {
+    /* Nothing to merge with, so at a cap of 1 the inline hypothesis is
+     * dropped and its replacement goes inline too
+     */
+    if(parameters.maximum_hypotheses == 1)
+    {
+      inline_hypothesis_valid_ = false;
+      nominated_hypothesis_ = -1;
+    }
+    return;
+  }
+
+  while(depth_hypotheses_.size() >= parameters.maximum_hypotheses)
+  {
+    /* Weakest is the hypothesis with the fewest samples; on ties the
+     * most recently proposed one goes first.
+     */
+    std::size_t weakest = 0;
+    for(std::size_t i = 1; i < depth_hypotheses_.size(); i++)
+      if(depth_hypotheses_[i].number_of_samples <= depth_hypotheses_[weakest].number_of_samples)
+        weakest = i;
+
+    const auto& w = depth_hypotheses_[weakest];
+
+    /* Closest remaining hypothesis by squared normalised separation */
+    Hypothesis* closest = nullptr;
+    double min_separation_squared = double(parameters.estimateOffset())*parameters.estimateOffset();
+    for(std::size_t i = 0; i < depth_hypotheses_.size(); i++)
+    {
+      if(i == weakest)
+        continue;
+      auto& h = depth_hypotheses_[i];
+      double difference = double(h.current_estimate) - w.current_estimate;
+      double separation_squared = difference*difference/(double(h.current_variance) + w.current_variance);
+      if(separation_squared < min_separation_squared)
+      {
+        min_separation_squared = separation_squared;
+        closest = &h;
+      }
+    }
+
+    if(closest)
+    {
+      /* Combine the two estimates by inverse variance weighting */
+      double current_sum = double(closest->current_variance) + w.current_variance;
+      closest->current_estimate = (double(closest->current_estimate)*w.current_variance + double(w.current_estimate)*closest->current_variance)/current_sum;
+      closest->current_variance = double(closest->current_variance)*w.current_variance/current_sum;
+
+      double predicted_sum = double(closest->predicted_variance) + w.predicted_variance;
+      closest->predicted_estimate = (double(closest->predicted_estimate)*w.predicted_variance + double(w.predicted_estimate)*closest->predicted_variance)/predicted_sum;
+      closest->predicted_variance = double(closest->predicted_variance)*w.predicted_variance/predicted_sum;
+
+      closest->number_of_samples += w.number_of_samples;
+      closest->resetMonitor();
+    }
+
+    depth_hypotheses_.erase(depth_hypotheses_.begin() + weakest);
+
+    if(nominated_hypothesis_ == int32_t(weakest))
+      nominated_hypothesis_ = -1;
+    else if(nominated_hypothesis_ > int32_t(weakest))
+      --nominated_hypothesis_;
+  }
+
+  for(std::size_t i = 0; i < depth_hypotheses_.size(); i++)
+    depth_hypotheses_[i].hypothesis_number = i;
+}
+
+std::size_t Node::hypothesisCount() const
+{
+  if(inline_hypothesis_valid_)
+    return 1;
+  return depth_hypotheses_.size();
+}
+
+int32_t Node::enumerateHypotheses(const Parameters& parameters, std::vector<HypothesisSummary>& summaries) const
+{
+  int32_t nominated = -1;
+  auto h = hypotheses();
+  auto count = hypothesisCount();
+  int32_t reported = 0;
+  for(std::size_t i = 0; i < count; i++)
+    if(h[i].number_of_samples > 0)
+    {
+      if(int32_t(i) == nominated_hypothesis_)
+        nominated = reported;
+      summaries.push_back({float(h[i].current_estimate), float(parameters.stddev_to_confidence_interval_scale*std::sqrt(h[i].current_variance)), h[i].number_of_samples});
+      ++reported;
+    }
+  return nominated;
+}
+
+std::size_t Node::queuedCount() const
+{
+  return queue_.size();
+}
 
 bool Node::update(float depth, float variance, const Parameters& parameters)
 {
@@ -38,6 +171,7 @@ bool Node::update(float depth, float variance, const Parameters& parameters)
 			 * start a new hypothesis to capture the outlier/datum shift.
 			 */
       best->resetMonitor();
+      limitHypotheses(parameters);
       addHypothesis(depth, variance);
     }
 
@@ -45,19 +179,25 @@ bool Node::update(float depth, float variance, const Parameters& parameters)
   return true;
 }
 
-std::shared_ptr<Hypothesis> Node::bestHypothesis(float depth, float variance)
+Hypothesis* Node::bestHypothesis(float depth, float variance)
 {
-  std::shared_ptr<Hypothesis> ret;
-  double min_error = std::numeric_limits<float>::max();
+  /* Squared normalised errors give the same ordering as the normalised
+   * absolute errors without the sqrt.  The strict comparison keeps the
+   * first hypothesis on ties.
+   */
+  Hypothesis* ret = nullptr;
+  double min_error_squared = double(std::numeric_limits<float>::max())*std::numeric_limits<float>::max();
 
-  for(const auto& h: depth_hypotheses_)
+  auto h = hypotheses();
+  auto count = hypothesisCount();
+  for(std::size_t i = 0; i < count; i++)
   {
-    double forecast_variance = h->predicted_variance + variance;
-    double error = std::abs(depth - h->predicted_estimate)/std::sqrt(forecast_variance);
-    if(error < min_error)
+    double innovation = depth - double(h[i].predicted_estimate);
+    double error_squared = innovation*innovation/(double(h[i].predicted_variance) + variance);
+    if(error_squared < min_error_squared)
     {
-      min_error = error;
-      ret = h;
+      min_error_squared = error_squared;
+      ret = h + i;
     }
   }
   return ret;
@@ -106,7 +246,7 @@ bool Node::insert(double node_x, double node_y, double distance_squared, const S
   // }
 
   /* Adding data removes any nomination in effect */
-  nominated_hypothesis_.reset();
+  nominated_hypothesis_ = -1;
 
   return queueEstimate(sounding.depth+offset, variance, parameters);
 
@@ -114,10 +254,12 @@ bool Node::insert(double node_x, double node_y, double distance_squared, const S
 
 bool Node::queueEstimate(float depth, float variance, const Parameters & parameters)
 {
+  if(queue_.empty())
+    queue_.reserve(parameters.median_length);
+
   if(queue_.size() >= parameters.median_length)
   {
-    auto mi = queue_.begin();
-    advance(mi, parameters.median_length/2);
+    auto mi = queue_.begin() + parameters.median_length/2;
     update(mi->depth, mi->uncertainty, parameters);
     queue_.erase(mi);
   }
@@ -125,7 +267,7 @@ bool Node::queueEstimate(float depth, float variance, const Parameters & paramet
   auto i = queue_.begin();
   while(i != queue_.end() && i->depth > depth)
     i++;
-  queue_.insert(i, DepthAndUncertainty(depth, variance));
+  queue_.emplace(i, depth, variance);
 
   if(queue_.size() >= parameters.median_length)
   {
@@ -150,8 +292,19 @@ bool Node::queueEstimate(float depth, float variance, const Parameters & paramet
 
 DepthAndUncertainty Node::extractDepthAndUncertainty(const Parameters & parameters)
 {
-  if(nominated_hypothesis_)
-    return {nominated_hypothesis_->current_estimate, parameters.stddev_to_confidence_interval_scale*std::sqrt(nominated_hypothesis_->current_variance)};
+  if(inline_hypothesis_valid_)
+  {
+    /* Fast path: any nomination can only be the inline hypothesis */
+    if(nominated_hypothesis_ >= 0 || inline_hypothesis_.number_of_samples > 0)
+      return {float(inline_hypothesis_.current_estimate), float(parameters.stddev_to_confidence_interval_scale*std::sqrt(inline_hypothesis_.current_variance))};
+    return {};
+  }
+
+  if(nominated_hypothesis_ >= 0)
+  {
+    const auto& nominated = depth_hypotheses_[nominated_hypothesis_];
+    return {float(nominated.current_estimate), float(parameters.stddev_to_confidence_interval_scale*std::sqrt(nominated.current_variance))};
+  }
 
   auto h = chooseHypothesis();
 
@@ -168,15 +321,59 @@ DepthAndUncertainty Node::extractDepthAndUncertainty(const Parameters & paramete
   return {};
 }
 
-std::shared_ptr<Hypothesis> Node::chooseHypothesis()
+NodeValues Node::extractValues(const Parameters & parameters)
 {
-  std::shared_ptr<Hypothesis> ret;
-  int max_sample_count = 0;
-  for(auto h: depth_hypotheses_)
-    if(h->number_of_samples > max_sample_count)
+  /* Ceiling of the hypothesis strength ratio, MAX_HYPOTHESIS_RATIO in the
+   * original code
+   */
+  const float maximum_ratio = 5.0;
+
+  NodeValues ret;
+  auto estimate = extractDepthAndUncertainty(parameters);
+  ret.depth = estimate.depth;
+  ret.uncertainty = estimate.uncertainty;
+
+  auto h = hypotheses();
+  auto count = hypothesisCount();
+  ret.hypothesis_count = count;
+
+  uint32_t best = 0;
+  uint32_t next_best = 0;
+  for(std::size_t i = 0; i < count; i++)
+  {
+    auto samples = h[i].number_of_samples;
+    ret.sample_count += samples;
+    if(samples > best)
     {
-      ret = h;
-      max_sample_count = h->number_of_samples;
+      next_best = best;
+      best = samples;
+    }
+    else if(samples > next_best)
+      next_best = samples;
+  }
+  ret.sample_count += queue_.size();
+
+  if(!std::isnan(ret.depth))
+  {
+    if(nominated_hypothesis_ >= 0 || next_best == 0)
+      ret.ratio = 0.0;
+    else
+      ret.ratio = std::max(0.0f, maximum_ratio - float(best)/next_best);
+  }
+  return ret;
+}
+
+Hypothesis* Node::chooseHypothesis()
+{
+  Hypothesis* ret = nullptr;
+  uint32_t max_sample_count = 0;
+  auto h = hypotheses();
+  auto count = hypothesisCount();
+  for(std::size_t i = 0; i < count; i++)
+    if(h[i].number_of_samples > max_sample_count)
+    {
+      ret = h + i;
+      max_sample_count = h[i].number_of_samples;
     }
   return ret;
 }
@@ -199,15 +396,13 @@ void Node::truncate(const Parameters & parameters)
 
   /* Run the list computing quotients; outliers are removed from the queue.
    */
-  for(auto i = queue_.begin(); i != queue_.end();)
+  auto outlier = [&](const DepthAndUncertainty& p)
   {
-    auto diff_sq = (i->depth - mean)*(i->depth - mean);
+    auto diff_sq = (p.depth - mean)*(p.depth - mean);
     auto q = diff_sq/(ssd_k - diff_sq/(n-1));
-    if(q > parameters.quotient_limit)
-      i = queue_.erase(i);
-    else
-      ++i;
-  }
+    return q > parameters.quotient_limit;
+  };
+  queue_.erase(std::remove_if(queue_.begin(), queue_.end(), outlier), queue_.end());
 
 }
 
@@ -221,12 +416,13 @@ void Node::queueFlush(const Parameters & parameters)
 
   while(!queue_.empty())
   {
-    auto mi = queue_.begin();
-    advance(mi, queue_.size()/2);
+    auto mi = queue_.begin() + queue_.size()/2;
     update(mi->depth, mi->uncertainty, parameters);
     queue_.erase(mi);
   }
 
+  /* Give the queue's memory back; it is reserved again on the next sample */
+  std::vector<DepthAndUncertainty>().swap(queue_);
 }
 
 
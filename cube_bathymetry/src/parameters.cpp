@@ -1,6 +1,9 @@
 #include "cube_bathymetry/parameters.h"
 #include <stdexcept>
 #include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <string>
 
 namespace cube
 {
@@ -10,6 +13,7 @@ Parameters::Parameters(CellSizes sizes, std::string order)
 {
   setIHOLimits(order);
   setGridResolution(sizes);
+  setMonitoringThresholds(estimate_offset_, bayes_factor_threshold_);
 }
 
 void Parameters::setIHOLimits(std::string order)
@@ -62,6 +66,164 @@ void Parameters::setGridResolution(CellSizes sizes)
 
 }
 
+void Parameters::setMonitoringThresholds(float estimate_offset, float bayes_factor_threshold)
+{
+  estimate_offset_ = estimate_offset;
+  bayes_factor_threshold_ = bayes_factor_threshold;
+
+  log_bayes_factor_offset_ = 0.5*double(estimate_offset)*estimate_offset;
+  log_bayes_factor_threshold_ = std::log(double(bayes_factor_threshold));
+}
+
+namespace
+{
+
+double parseNumber(const std::string& name, const std::string& value)
+{
+  char* end = nullptr;
+  double ret = std::strtod(value.c_str(), &end);
+  if(value.empty() || *end != '\0')
+    throw std::invalid_argument("Invalid value for "+name+": "+value);
+  return ret;
+}
+
+uint32_t parseCount(const std::string& name, const std::string& value, uint32_t minimum = 0, uint32_t maximum = std::numeric_limits<uint32_t>::max())
+{
+  double ret = parseNumber(name, value);
+  if(ret < 0 || ret != std::floor(ret) || ret > std::numeric_limits<uint32_t>::max())
+    throw std::invalid_argument("Invalid value for "+name+": "+value);
+  if(ret < minimum || ret > maximum)
+    throw std::invalid_argument(name+" must be between "+std::to_string(minimum)+" and "+std::to_string(maximum)+": "+value);
+  return ret;
+}
+
+bool parseFlag(const std::string& name, const std::string& value)
+{
+  if(value == "true" || value == "1")
+    return true;
+  if(value == "false" || value == "0")
+    return false;
+  throw std::invalid_argument("Invalid value for "+name+": "+value);
+}
+
+CubeExtractor parseExtractor(const std::string& value)
+{
+  if(value == "prior")
+    return CUBE_PRIOR;
+  if(value == "likelihood")
+    return CUBE_LHOOD;
+  if(value == "posterior")
+    return CUBE_POSTERIOR;
+  if(value == "predicted_surface")
+    return CUBE_PREDSURF;
+  throw std::invalid_argument("Unknown extractor: "+value+" (expected prior, likelihood, posterior or predicted_surface)");
+}
+
+} // namespace
+
+const std::vector<std::string>& Parameters::names()
+{
+  static const std::vector<std::string> ret = {
+    "no_data_value", "extractor", "nodata_depth", "nodata_variance",
+    "distance_exponent", "distance_scale", "variance_scale", "iho_order",
+    "median_length", "quotient_limit", "discount", "estimate_offset",
+    "bayes_factor_threshold", "runlength_threshold", "log_domain_monitoring",
+    "maximum_hypotheses", "minimum_context_search_range",
+    "maximum_context_search_range", "stddev_to_confidence_interval_scale",
+    "blunder_minimum", "blunder_percent", "blunder_scalar",
+    "capture_distance_scale"};
+  return ret;
+}
+
+void Parameters::set(const std::string& name, const std::string& value)
+{
+  if(name == "no_data_value")
+    no_data_value = parseNumber(name, value);
+  else if(name == "extractor")
+    extractor = parseExtractor(value);
+  else if(name == "nodata_depth")
+    nodata_depth = parseNumber(name, value);
+  else if(name == "nodata_variance")
+    nodata_variance = parseNumber(name, value);
+  else if(name == "distance_exponent")
+  {
+    distance_exponent = parseNumber(name, value);
+    if(distance_exponent <= 0.0)
+      throw std::invalid_argument("distance_exponent must be positive");
+    inverse_distance_exponent = 1.0/distance_exponent;
+    variance_scale = std::pow(distance_scale, -distance_exponent);
+  }
+  else if(name == "distance_scale")
+  {
+    distance_scale = parseNumber(name, value);
+    variance_scale = std::pow(distance_scale, -distance_exponent);
+  }
+  else if(name == "variance_scale")
+    variance_scale = parseNumber(name, value);
+  else if(name == "iho_order")
+  {
+    setIHOLimits(value);
+    iho_order = value;
+  }
+  else if(name == "median_length")
+    // The original CUBE requires at least 3; 1 disables the pre-filter.
+    // Each node reserves a queue of this length.
+    median_length = parseCount(name, value, 1, 1000);
+  else if(name == "quotient_limit")
+  {
+    // Quotients are non-negative, so a limit of 0 or less rejects every sounding
+    auto limit = parseNumber(name, value);
+    if(!(limit > 0.0))
+      throw std::invalid_argument("quotient_limit must be positive");
+    quotient_limit = limit;
+  }
+  else if(name == "discount")
+  {
+    // The evolution noise is the previous variance scaled by 1/discount - 1
+    auto factor = parseNumber(name, value);
+    if(!(factor > 0.0 && factor <= 1.0))
+      throw std::invalid_argument("discount must be greater than 0 and at most 1");
+    discount = factor;
+  }
+  else if(name == "estimate_offset")
+    setMonitoringThresholds(parseNumber(name, value), bayes_factor_threshold_);
+  else if(name == "bayes_factor_threshold")
+  {
+    auto threshold = parseNumber(name, value);
+    if(!(threshold > 0.0))
+      throw std::invalid_argument("bayes_factor_threshold must be positive");
+    setMonitoringThresholds(estimate_offset_, threshold);
+  }
+  else if(name == "runlength_threshold")
+    runlength_threshold = parseCount(name, value, 1);
+  else if(name == "log_domain_monitoring")
+    log_domain_monitoring = parseFlag(name, value);
+  else if(name == "maximum_hypotheses")
+    maximum_hypotheses = parseCount(name, value);
+  else if(name == "minimum_context_search_range")
+    minimum_context_search_range = parseNumber(name, value);
+  else if(name == "maximum_context_search_range")
+    maximum_context_search_range = parseNumber(name, value);
+  else if(name == "stddev_to_confidence_interval_scale")
+    stddev_to_confidence_interval_scale = parseNumber(name, value);
+  else if(name == "blunder_minimum")
+    blunder_minimum = parseNumber(name, value);
+  else if(name == "blunder_percent")
+    blunder_percent = parseNumber(name, value);
+  else if(name == "blunder_scalar")
+    blunder_scalar = parseNumber(name, value);
+  else if(name == "capture_distance_scale")
+    capture_distance_scale = parseNumber(name, value);
+  else
+    throw std::invalid_argument("Unknown parameter: "+name);
+}
+
+void Parameters::validate() const
+{
+  if(minimum_context_search_range > maximum_context_search_range)
+    throw std::invalid_argument("minimum_context_search_range must not exceed maximum_context_search_range");
+}
+
 
 
 } // namespace cube
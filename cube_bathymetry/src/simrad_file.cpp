@@ -0,0 +1,490 @@
+#include "cube_bathymetry/simrad_file.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cube
+{
+
+namespace
+{
+
+constexpr uint8_t STX = 0x02;
+constexpr uint8_t ETX = 0x03;
+constexpr uint8_t DEPTH_DATAGRAM = 0x44;
+constexpr uint8_t POSITION_DATAGRAM = 0x50;
+
+/// Size field, STX, type, model, date and time
+constexpr std::size_t HEADER_SIZE = 16;
+/// ETX and checksum
+constexpr std::size_t TAIL_SIZE = 3;
+/// Ping number to sample rate, before the beams
+constexpr std::size_t DEPTH_HEADER_SIZE = 16;
+constexpr std::size_t DEPTH_BEAM_SIZE = 16;
+/// Counter, serial number, latitude, longitude, fix quality, speed,
+/// course, heading and position system descriptor
+constexpr std::size_t POSITION_SIZE = 21;
+/// Position system descriptor bit set for the active positioning system
+constexpr uint8_t ACTIVE_POSITION_SYSTEM = 0x80;
+
+/// EM models whose beam depths are unsigned
+constexpr uint16_t EM120 = 120;
+constexpr uint16_t EM300 = 300;
+
+/// Limits used by read_simrad.c
+constexpr uint32_t MAXIMUM_DATAGRAM_SIZE = 40960;
+constexpr std::size_t MAXIMUM_RESYNCHRONISATION = 1024;
+
+constexpr double DEGREES_TO_RADIANS = M_PI/180.0;
+
+/// Batches decoded ahead of the consumer for each file
+constexpr std::size_t READ_AHEAD_BATCHES = 4;
+
+/// Integer field at p, independent of the host byte order
+template<typename T>
+T field(const uint8_t* p, bool big_endian)
+{
+  uint64_t value = 0;
+  for(std::size_t i = 0; i < sizeof(T); i++)
+    value = value << 8 | p[big_endian ? i : sizeof(T)-1-i];
+  return static_cast<T>(static_cast<typename std::make_unsigned<T>::type>(value));
+}
+
+/// Whether the checksum of the datagram of length bytes at datagram,
+/// including the size field, is the sum of the bytes between STX and ETX
+bool checksumMatches(const uint8_t* datagram, std::size_t length, bool big_endian)
+{
+  uint16_t sum = 0;
+  for(std::size_t i = 5; i < length - TAIL_SIZE; i++)
+    sum += datagram[i];
+  return sum == field<uint16_t>(datagram + length - 2, big_endian);
+}
+
+/// Length of the datagram at offset, including the size field, or 0 if
+/// there isn't a well formed datagram there.  When check_sum is set the
+/// datagram's checksum must match as well.
+std::size_t datagramLength(const uint8_t* bytes, std::size_t size, std::size_t offset, bool big_endian, bool check_sum)
+{
+  if(size - offset < HEADER_SIZE || bytes[offset+4] != STX)
+    return 0;
+  uint32_t datagram_size = field<uint32_t>(bytes+offset, big_endian);
+  if(datagram_size > MAXIMUM_DATAGRAM_SIZE || datagram_size < HEADER_SIZE - 4 + TAIL_SIZE || datagram_size > size - offset - 4)
+    return 0;
+  if(bytes[offset + 4 + datagram_size - TAIL_SIZE] != ETX)
+    return 0;
+  if(check_sum && !checksumMatches(bytes + offset, 4 + datagram_size, big_endian))
+    return 0;
+  return 4 + datagram_size;
+}
+
+/// Call visit(offset, length) for each datagram in the mapping until it
+/// returns false, skipping corrupt stretches.  The byte order is taken
+/// from the first datagram found, preferring big endian like the
+/// original reader.  Once a byte has been skipped, a datagram is only
+/// accepted if its checksum matches, so that a stray STX and ETX the
+/// right distance apart in the corrupt stretch don't resynchronise on
+/// the wrong bytes.  Returns the number of bytes skipped.
+template<typename Visit>
+std::size_t walkDatagrams(const std::string& filename, const uint8_t* bytes, std::size_t size, bool& big_endian, Visit visit)
+{
+  bool order_known = false;
+  std::size_t skipped = 0;
+  std::size_t run = 0;
+  for(std::size_t offset = 0; size - offset >= HEADER_SIZE;)
+  {
+    bool check_sum = run > 0;
+    std::size_t length = datagramLength(bytes, size, offset, big_endian, check_sum);
+    if(length == 0 && !order_known)
+    {
+      big_endian = !big_endian;
+      length = datagramLength(bytes, size, offset, big_endian, check_sum);
+      if(length == 0)
+        big_endian = !big_endian;
+    }
+    if(length == 0)
+    {
+      if(++run > MAXIMUM_RESYNCHRONISATION)
+        throw std::runtime_error("failed to resynchronise " + filename + " after " + std::to_string(MAXIMUM_RESYNCHRONISATION) + " bytes at offset " + std::to_string(offset) + ", file corrupt?");
+      skipped++;
+      offset++;
+      continue;
+    }
+    order_known = true;
+    run = 0;
+    if(!visit(offset, length))
+      break;
+    offset += length;
+  }
+  if(!order_known)
+    throw std::runtime_error(filename + " is not an EM series raw file");
+  return skipped;
+}
+
+/// Seconds since the epoch of a datagram's date (yyyymmdd) and time
+/// (milliseconds since midnight)
+double timestamp(uint32_t date, uint32_t milliseconds)
+{
+  int64_t year = date/10000;
+  int64_t month = date/100%100;
+  int64_t day = date%100;
+  /* Days since 1970-01-01 in the proleptic Gregorian calendar */
+  year -= month <= 2;
+  int64_t era = year/400;
+  int64_t year_of_era = year - era*400;
+  int64_t day_of_year = (153*(month > 2 ? month-3 : month+9) + 2)/5 + day - 1;
+  int64_t day_of_era = year_of_era*365 + year_of_era/4 - year_of_era/100 + day_of_year;
+  return (era*146097 + day_of_era - 719468)*86400.0 + milliseconds/1000.0;
+}
+
+double datagramTime(const uint8_t* datagram, bool big_endian)
+{
+  return timestamp(field<uint32_t>(datagram+8, big_endian), field<uint32_t>(datagram+12, big_endian));
+}
+
+/// Whether the datagram is a position datagram from the active
+/// positioning system.  Fixes from the other systems are logged too, and
+/// interleaving them would make the navigation jump between antennas.
+bool activePosition(const uint8_t* datagram, std::size_t length)
+{
+  return datagram[5] == POSITION_DATAGRAM && length >= HEADER_SIZE + POSITION_SIZE + TAIL_SIZE &&
+         (datagram[HEADER_SIZE + 20] & ACTIVE_POSITION_SYSTEM);
+}
+
+void* mapFile(const std::string& filename, std::size_t& size)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw std::runtime_error("unable to open " + filename + ": " + std::strerror(errno));
+  struct stat status;
+  if(fstat(fd, &status) != 0)
+  {
+    close(fd);
+    throw std::runtime_error("unable to stat " + filename + ": " + std::strerror(errno));
+  }
+  size = status.st_size;
+  if(size < HEADER_SIZE)
+  {
+    close(fd);
+    throw std::runtime_error(filename + " is not an EM series raw file");
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+    throw std::runtime_error("unable to map " + filename + ": " + std::strerror(errno));
+  return mapping;
+}
+
+} // namespace
+
+SimradFile::SimradFile(const std::string& filename)
+{
+  mapping_ = mapFile(filename, mapping_size_);
+  /* Indexed front to back, then decoded mostly in order */
+  madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+
+  try
+  {
+    auto data = bytes();
+    skipped_bytes_ = walkDatagrams(filename, data, mapping_size_, big_endian_, [&](std::size_t offset, std::size_t length)
+    {
+      const uint8_t* datagram = data + offset;
+      if(datagram[5] == DEPTH_DATAGRAM && length >= HEADER_SIZE + DEPTH_HEADER_SIZE + 1 + TAIL_SIZE)
+      {
+        std::size_t valid_beams = datagram[HEADER_SIZE + 11];
+        if(length >= HEADER_SIZE + DEPTH_HEADER_SIZE + valid_beams*DEPTH_BEAM_SIZE + 1 + TAIL_SIZE)
+          depth_offsets_.push_back(offset);
+      }
+      else if(activePosition(datagram, length))
+      {
+        Fix fix;
+        fix.time = datagramTime(datagram, big_endian_);
+        fix.latitude = field<int32_t>(datagram + HEADER_SIZE + 4, big_endian_)/20000000.0;
+        fix.longitude = field<int32_t>(datagram + HEADER_SIZE + 8, big_endian_)/10000000.0;
+        fixes_.push_back(fix);
+      }
+      return true;
+    });
+  }
+  catch(...)
+  {
+    munmap(mapping_, mapping_size_);
+    throw;
+  }
+
+  std::stable_sort(fixes_.begin(), fixes_.end(), [](const Fix& a, const Fix& b){return a.time < b.time;});
+}
+
+SimradFile::~SimradFile()
+{
+  munmap(mapping_, mapping_size_);
+}
+
+const uint8_t* SimradFile::bytes() const
+{
+  return static_cast<const uint8_t*>(mapping_);
+}
+
+std::size_t SimradFile::pingCount() const
+{
+  return depth_offsets_.size();
+}
+
+std::size_t SimradFile::skippedBytes() const
+{
+  return skipped_bytes_;
+}
+
+bool SimradFile::decodePing(std::size_t ping, const LocalProjection& projection, const SimradReaderOptions& options, std::vector<Sounding>& soundings) const
+{
+  const uint8_t* datagram = bytes() + depth_offsets_[ping];
+  const uint8_t* header = datagram + HEADER_SIZE;
+
+  /* Navigation at the ping time, which can't be extrapolated */
+  double time = datagramTime(datagram, big_endian_);
+  if(fixes_.empty() || time < fixes_.front().time || time > fixes_.back().time)
+    return false;
+  auto after = std::lower_bound(fixes_.begin(), fixes_.end(), time, [](const Fix& fix, double t){return fix.time < t;});
+  double latitude = after->latitude;
+  double longitude = after->longitude;
+  if(after != fixes_.begin())
+  {
+    auto before = after - 1;
+    double fraction = (time - before->time)/(after->time - before->time);
+    latitude = before->latitude + fraction*(after->latitude - before->latitude);
+    longitude = before->longitude + fraction*std::remainder(after->longitude - before->longitude, 360.0);
+  }
+  auto transducer = projection.project(latitude, longitude);
+
+  uint16_t model = field<uint16_t>(datagram+6, big_endian_);
+  bool unsigned_depth = model == EM120 || model == EM300;
+  double heading = field<uint16_t>(header+4, big_endian_)/100.0*DEGREES_TO_RADIANS;
+  double sin_heading = std::sin(heading);
+  double cos_heading = std::cos(heading);
+  std::size_t valid_beams = header[11];
+  double z_scale = header[12]/100.0;
+  double xy_scale = header[13]/100.0;
+  const uint8_t* beams = header + DEPTH_HEADER_SIZE;
+  int8_t depth_offset_multiplier = static_cast<int8_t>(beams[valid_beams*DEPTH_BEAM_SIZE]);
+  double z_offset = field<uint16_t>(header+8, big_endian_)/100.0 + depth_offset_multiplier*655.36;
+  float vertical_variance = options.vertical_error*options.vertical_error;
+  float horizontal_variance = options.horizontal_error*options.horizontal_error;
+
+  for(std::size_t i = 0; i < valid_beams; i++)
+  {
+    const uint8_t* beam = beams + i*DEPTH_BEAM_SIZE;
+    /* Depths are below the transducer, and unsigned on the EM120 and
+     * EM300, which reach past 327.67 m at the finest resolution
+     */
+    double depth = unsigned_depth ? field<uint16_t>(beam, big_endian_) : field<int16_t>(beam, big_endian_);
+    double across = field<int16_t>(beam+2, big_endian_)*xy_scale;
+    double along = field<int16_t>(beam+4, big_endian_)*xy_scale;
+    Sounding s;
+    s.x = transducer.x + along*sin_heading + across*cos_heading;
+    s.y = transducer.y + along*cos_heading - across*sin_heading;
+    s.depth = depth*z_scale + z_offset;
+    s.vertical_error = vertical_variance;
+    s.horizontal_error = horizontal_variance;
+    soundings.push_back(s);
+  }
+  return true;
+}
+
+bool SimradFile::firstPosition(const std::string& filename, double& latitude, double& longitude)
+{
+  std::size_t size;
+  void* mapping = mapFile(filename, size);
+  auto data = static_cast<const uint8_t*>(mapping);
+  bool found = false;
+  bool big_endian = true;
+  try
+  {
+    walkDatagrams(filename, data, size, big_endian, [&](std::size_t offset, std::size_t length)
+    {
+      if(!activePosition(data + offset, length))
+        return true;
+      latitude = field<int32_t>(data + offset + HEADER_SIZE + 4, big_endian)/20000000.0;
+      longitude = field<int32_t>(data + offset + HEADER_SIZE + 8, big_endian)/10000000.0;
+      found = true;
+      return false;
+    });
+  }
+  catch(...)
+  {
+    munmap(mapping, size);
+    throw;
+  }
+  munmap(mapping, size);
+  return found;
+}
+
+namespace
+{
+
+/// Indexes and decodes one file on its own thread, into a ring of
+/// batches the consumer swaps out in order
+class FileDecoder
+{
+public:
+  FileDecoder(const std::string& filename, const LocalProjection& projection, const SimradReaderOptions& options, std::size_t batch_size)
+    :filename_(filename), projection_(projection), options_(options), batch_size_(batch_size), slots_(READ_AHEAD_BATCHES)
+  {
+    thread_ = std::thread(&FileDecoder::decode, this);
+  }
+
+  ~FileDecoder()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    slot_free_.notify_one();
+    thread_.join();
+  }
+
+  /// Swap the next batch into batch, returning false when the file is done
+  bool next(std::vector<Sounding>& batch)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_ready_.wait(lock, [this]{return ready_ > 0 || done_;});
+    if(ready_ == 0)
+    {
+      if(error_)
+        std::rethrow_exception(error_);
+      return false;
+    }
+    batch.swap(slots_[first_]);
+    first_ = (first_ + 1)%slots_.size();
+    ready_--;
+    lock.unlock();
+    slot_free_.notify_one();
+    return true;
+  }
+
+  uint64_t pingCount()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ping_count_;
+  }
+
+private:
+  /// Wait for a free slot, returning false if stopped
+  bool acquire(std::size_t& slot)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    slot_free_.wait(lock, [this]{return stop_ || ready_ < slots_.size();});
+    slot = (first_ + ready_)%slots_.size();
+    slots_[slot].clear();
+    return !stop_;
+  }
+
+  void publish()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_++;
+    }
+    slot_ready_.notify_one();
+  }
+
+  void decode()
+  {
+    uint64_t ping_count = 0;
+    try
+    {
+      SimradFile file(filename_);
+      std::size_t slot;
+      if(!acquire(slot))
+        return;
+      for(std::size_t ping = 0; ping < file.pingCount(); ping++)
+      {
+        // The consumer only touches ready slots, so this one is ours
+        if(file.decodePing(ping, projection_, options_, slots_[slot]))
+          ping_count++;
+        if(slots_[slot].size() >= batch_size_)
+        {
+          publish();
+          if(!acquire(slot))
+            return;
+        }
+      }
+      if(!slots_[slot].empty())
+        publish();
+    }
+    catch(...)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ping_count_ = ping_count;
+      done_ = true;
+    }
+    slot_ready_.notify_one();
+  }
+
+  std::string filename_;
+  LocalProjection projection_;
+  SimradReaderOptions options_;
+  std::size_t batch_size_;
+
+  std::vector<std::vector<Sounding> > slots_;
+  std::size_t first_ = 0;
+  std::size_t ready_ = 0;
+  bool done_ = false;
+  bool stop_ = false;
+  std::exception_ptr error_;
+  uint64_t ping_count_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable slot_ready_;
+  std::condition_variable slot_free_;
+  std::thread thread_;
+};
+
+} // namespace
+
+uint64_t readSimradFiles(const std::vector<std::string>& filenames, const LocalProjection& projection, const SimradReaderOptions& options, std::size_t threads, std::size_t batch_size, const std::function<void(const Sounding*, const Sounding*)>& consume)
+{
+  threads = std::max<std::size_t>(1, threads);
+  batch_size = std::max<std::size_t>(1, batch_size);
+
+  /* The decoders for the files after the one being consumed run ahead,
+   * so they overlap with adding the current file to the sheet.
+   */
+  std::deque<std::unique_ptr<FileDecoder> > decoders;
+  std::size_t next_file = 0;
+  auto start_decoders = [&]()
+  {
+    while(next_file < filenames.size() && decoders.size() < threads)
+      decoders.emplace_back(new FileDecoder(filenames[next_file++], projection, options, batch_size));
+  };
+
+  uint64_t ping_count = 0;
+  std::vector<Sounding> batch;
+  start_decoders();
+  while(!decoders.empty())
+  {
+    while(decoders.front()->next(batch))
+      consume(batch.data(), batch.data() + batch.size());
+    ping_count += decoders.front()->pingCount();
+    decoders.pop_front();
+    start_decoders();
+  }
+  return ping_count;
+}
+
+} // namespace cube
@@ -0,0 +1,202 @@
+#include "cube_bathymetry/sounding_file.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cube
+{
+
+namespace
+{
+
+const char MAGIC[8] = {'C', 'U', 'B', 'E', 'S', 'N', 'D', '\0'};
+constexpr uint32_t VERSION = 1;
+constexpr std::size_t HEADER_SIZE = 16;
+
+/* Records are used in place, so they must match Sounding exactly */
+static_assert(sizeof(Sounding) == 32, "Sounding must match the binary soundings record");
+static_assert(std::is_trivially_copyable<Sounding>::value, "Sounding must match the binary soundings record");
+static_assert(HEADER_SIZE % alignof(Sounding) == 0, "Records must be aligned in the mapping");
+
+bool littleEndian()
+{
+  uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+} // namespace
+
+MappedSoundingFile::MappedSoundingFile(const std::string& filename)
+{
+  if(!littleEndian())
+    throw std::runtime_error("binary soundings files can only be mapped on little endian machines");
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw std::runtime_error("unable to open " + filename + ": " + std::strerror(errno));
+  struct stat status;
+  if(fstat(fd, &status) != 0)
+  {
+    close(fd);
+    throw std::runtime_error("unable to stat " + filename + ": " + std::strerror(errno));
+  }
+  mapping_size_ = status.st_size;
+  if(mapping_size_ < HEADER_SIZE)
+  {
+    close(fd);
+    throw std::runtime_error(filename + " is too short to be a binary soundings file");
+  }
+  mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping_ == MAP_FAILED)
+  {
+    mapping_ = nullptr;
+    throw std::runtime_error("unable to map " + filename + ": " + std::strerror(errno));
+  }
+  /* Read once, front to back */
+  madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+
+  auto bytes = static_cast<const uint8_t*>(mapping_);
+  uint32_t version, record_size;
+  std::memcpy(&version, bytes+8, sizeof(version));
+  std::memcpy(&record_size, bytes+12, sizeof(record_size));
+  if(std::memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION || record_size != sizeof(Sounding) || (mapping_size_ - HEADER_SIZE) % sizeof(Sounding) != 0)
+  {
+    munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    throw std::runtime_error(filename + " is not a version 1 binary soundings file");
+  }
+
+  begin_ = reinterpret_cast<const Sounding*>(bytes+HEADER_SIZE);
+  end_ = begin_ + (mapping_size_ - HEADER_SIZE)/sizeof(Sounding);
+}
+
+MappedSoundingFile::~MappedSoundingFile()
+{
+  if(mapping_)
+    munmap(mapping_, mapping_size_);
+}
+
+const Sounding* MappedSoundingFile::begin() const
+{
+  return begin_;
+}
+
+const Sounding* MappedSoundingFile::end() const
+{
+  return end_;
+}
+
+std::size_t MappedSoundingFile::size() const
+{
+  return end_ - begin_;
+}
+
+bool MappedSoundingFile::isBinary(const std::string& filename)
+{
+  std::ifstream in(filename, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  return in.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void readAsciiSoundings(const std::string& filename, std::size_t batch_size, const std::function<void(const Sounding*, const Sounding*)>& consume)
+{
+  std::ifstream in(filename);
+  if(!in)
+    throw std::runtime_error("unable to open " + filename);
+
+  std::vector<Sounding> batch;
+  batch.reserve(batch_size);
+  std::string line;
+  std::size_t line_number = 0;
+  while(std::getline(in, line))
+  {
+    ++line_number;
+    auto start = line.find_first_not_of(" \t\r");
+    if(start == std::string::npos || line[start] == '#')
+      continue;
+
+    const char* p = line.c_str();
+    char* next;
+    double values[5];
+    for(auto& v: values)
+    {
+      v = std::strtod(p, &next);
+      if(next == p)
+        throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": expected x y depth vertical_error horizontal_error");
+      p = next;
+    }
+
+    Sounding s;
+    s.x = values[0];
+    s.y = values[1];
+    s.depth = values[2];
+    s.vertical_error = values[3];
+    s.horizontal_error = values[4];
+    batch.push_back(s);
+    if(batch.size() >= batch_size)
+    {
+      consume(batch.data(), batch.data()+batch.size());
+      batch.clear();
+    }
+  }
+  if(in.bad())
+    throw std::runtime_error("error reading " + filename);
+  if(!batch.empty())
+    consume(batch.data(), batch.data()+batch.size());
+}
+
+SoundingFileWriter::SoundingFileWriter(const std::string& filename)
+  :filename_(filename)
+{
+  if(!littleEndian())
+    throw std::runtime_error("binary soundings files can only be written on little endian machines");
+
+  out_.open(filename, std::ios::binary);
+  if(!out_)
+    throw std::runtime_error("unable to create " + filename);
+  uint32_t header[2] = {VERSION, sizeof(Sounding)};
+  out_.write(MAGIC, sizeof(MAGIC));
+  out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+void SoundingFileWriter::write(const Sounding* begin, const Sounding* end)
+{
+  /* Zero the padding rather than writing whatever is in it */
+  records_.assign((end - begin)*sizeof(Sounding), 0);
+  char* record = records_.data();
+  for(auto s = begin; s != end; ++s, record += sizeof(Sounding))
+  {
+    std::memcpy(record, &s->x, sizeof(s->x));
+    std::memcpy(record+8, &s->y, sizeof(s->y));
+    std::memcpy(record+16, &s->depth, sizeof(s->depth));
+    std::memcpy(record+20, &s->vertical_error, sizeof(s->vertical_error));
+    std::memcpy(record+24, &s->horizontal_error, sizeof(s->horizontal_error));
+  }
+  out_.write(records_.data(), records_.size());
+  if(!out_)
+    throw std::runtime_error("error writing " + filename_);
+}
+
+void SoundingFileWriter::close()
+{
+  out_.close();
+  if(!out_)
+    throw std::runtime_error("error writing " + filename_);
+}
+
+void writeSoundingFile(const std::string& filename, const std::vector<Sounding>& soundings)
+{
+  SoundingFileWriter writer(filename);
+  writer.write(soundings.data(), soundings.data() + soundings.size());
+  writer.close();
+}
+
+} // namespace cube
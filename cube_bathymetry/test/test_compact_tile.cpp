@@ -0,0 +1,152 @@
+#include <cube_bathymetry/compact_tile.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+
+const cube::GridIndex grid_index(3, -2);
+const cube::CellCounts cell_counts(4, 3);
+
+/// A 4 by 3 grid with depths from depth to depth + 1.1 m
+std::vector<cube::DepthAndUncertainty> grid(float depth)
+{
+  std::vector<cube::DepthAndUncertainty> ret;
+  for(int i = 0; i < 12; i++)
+    ret.emplace_back(depth + 0.1*i, 0.2 + 0.01*i);
+  return ret;
+}
+
+/// Check decoded matches values to within the tile's quantisation step,
+/// with NaN in the same cells
+void expectDecoded(const std::vector<cube::DepthAndUncertainty>& values, const std::vector<cube::DepthAndUncertainty>& decoded, const cube::CompactTile& tile)
+{
+  ASSERT_EQ(values.size(), decoded.size());
+  for(std::size_t i = 0; i < values.size(); i++)
+  {
+    EXPECT_EQ(std::isnan(values[i].depth), std::isnan(decoded[i].depth)) << "cell " << i;
+    EXPECT_EQ(std::isnan(values[i].uncertainty), std::isnan(decoded[i].uncertainty)) << "cell " << i;
+    if(!std::isnan(values[i].depth))
+      EXPECT_NEAR(values[i].depth, decoded[i].depth, tile.depth_scale) << "cell " << i;
+    if(!std::isnan(values[i].uncertainty))
+      EXPECT_NEAR(values[i].uncertainty, decoded[i].uncertainty, tile.uncertainty_scale) << "cell " << i;
+  }
+}
+
+} // namespace
+
+TEST(CompactTile, NaNCellsRoundTrip)
+{
+  cube::CompactTileEncoder encoder;
+  cube::CompactTileDecoder decoder;
+  cube::CompactTile tile;
+  std::vector<cube::DepthAndUncertainty> decoded;
+
+  auto values = grid(20.0);
+  values[0] = cube::DepthAndUncertainty();
+  values[5].uncertainty = NAN;
+  values[11] = cube::DepthAndUncertainty();
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_EQ(tile.base_version, 0u);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+
+  /* A cell gaining and another losing a value in a delta */
+  values[0] = cube::DepthAndUncertainty(20.05, 0.2);
+  values[3] = cube::DepthAndUncertainty();
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_NE(tile.base_version, 0u);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+
+  /* Nothing to send once every cell is NaN */
+  EXPECT_FALSE(encoder.encode(grid_index, cell_counts, std::vector<cube::DepthAndUncertainty>(12), tile));
+}
+
+TEST(CompactTile, RangeGrowthSendsKeyTile)
+{
+  cube::CompactTileEncoder encoder;
+  cube::CompactTileDecoder decoder;
+  cube::CompactTile tile;
+  std::vector<cube::DepthAndUncertainty> decoded;
+
+  auto values = grid(20.0);
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  auto first_scale = tile.depth_scale;
+
+  /* A new shoal well outside the padded range of the first version */
+  values[6].depth = 5.0;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_EQ(tile.version, 2u);
+  EXPECT_EQ(tile.base_version, 0u);
+  EXPECT_GT(tile.depth_scale, first_scale);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+}
+
+TEST(CompactTile, DeltaWrapsAround)
+{
+  cube::CompactTileEncoder encoder;
+  cube::CompactTileDecoder decoder;
+  cube::CompactTile tile;
+  std::vector<cube::DepthAndUncertainty> decoded;
+
+  auto values = grid(20.0);
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+
+  /* Moving the deepest cell to the shallow end of the range and the
+   * shallowest to the deep end makes deltas that only decode modulo 2^16
+   */
+  float low = tile.depth_offset + tile.depth_scale;
+  float high = tile.depth_offset + 65530*tile.depth_scale;
+  values[0].depth = high;
+  values[11].depth = low;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  ASSERT_NE(tile.base_version, 0u);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+}
+
+TEST(CompactTile, DroppedTileRecoversAtKeyTile)
+{
+  const uint32_t key_interval = 4;
+  cube::CompactTileEncoder encoder(true, key_interval);
+  cube::CompactTileDecoder decoder;
+  cube::CompactTile tile;
+  std::vector<cube::DepthAndUncertainty> decoded;
+
+  auto values = grid(20.0);
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+
+  /* Version 2 is lost, so the deltas against it can't be applied */
+  values[1].depth += 0.05;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  values[2].depth += 0.05;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_EQ(tile.base_version, 2u);
+  EXPECT_FALSE(decoder.decode(tile, decoded));
+
+  values[3].depth += 0.05;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_EQ(tile.version, key_interval);
+  EXPECT_EQ(tile.base_version, 0u);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+
+  /* And deltas apply again after it */
+  values[4].depth += 0.05;
+  ASSERT_TRUE(encoder.encode(grid_index, cell_counts, values, tile));
+  EXPECT_EQ(tile.base_version, key_interval);
+  ASSERT_TRUE(decoder.decode(tile, decoded));
+  expectDecoded(values, decoded, tile);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
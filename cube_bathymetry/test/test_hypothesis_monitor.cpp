@@ -0,0 +1,157 @@
+#include <cube_bathymetry/node.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+
+/// A fixed sequence of depth samples at one node: 0.1 m noise on 20 m,
+/// 5% outliers at 8 sigma and a 1 m level shift for 100 of every 500
+/// samples, so both the single outlier and the cumulative run tests of
+/// the monitor are exercised.  The generator is seeded and only its raw
+/// output is used, so the sequence is the same everywhere.
+std::vector<cube::DepthAndUncertainty> recordedSequence(std::size_t count)
+{
+  std::mt19937 generator(20230601);
+  auto uniform = [&](){return (generator() + 0.5)/4294967296.0;};
+  std::vector<cube::DepthAndUncertainty> ret;
+  for(std::size_t i = 0; i < count; i++)
+  {
+    float variance = 0.01 + 0.1*uniform();
+    double normal = std::sqrt(-2.0*std::log(uniform()))*std::cos(2.0*M_PI*uniform());
+    double scale = uniform() < 0.05 ? 8.0 : 1.0;
+    double shift = i%500 >= 400 ? 1.0 : 0.0;
+    ret.push_back({float(20.0 + shift + scale*normal*std::sqrt(variance)), variance});
+  }
+  return ret;
+}
+
+cube::Parameters parameters(bool log_domain)
+{
+  cube::Parameters ret(cube::CellSizes(1.0));
+  ret.log_domain_monitoring = log_domain;
+  return ret;
+}
+
+} // namespace
+
+TEST(HypothesisMonitor, LogDomainMakesTheSameDecisions)
+{
+  auto samples = recordedSequence(20000);
+  auto linear = parameters(false);
+  auto log_domain = parameters(true);
+
+  cube::Hypothesis a(20.0, 0.05), b(20.0, 0.05);
+  std::size_t interventions = 0;
+  for(std::size_t i = 0; i < samples.size(); i++)
+  {
+    bool linear_supported = a.monitor(samples[i].depth, samples[i].uncertainty, linear);
+    bool log_supported = b.monitorLogDomain(samples[i].depth, samples[i].uncertainty, log_domain);
+    ASSERT_EQ(linear_supported, log_supported) << "at sample " << i;
+    ASSERT_EQ(a.sequence_length, b.sequence_length) << "at sample " << i;
+    if(!linear_supported)
+    {
+      interventions++;
+      a.resetMonitor();
+      b.resetMonitor();
+    }
+  }
+  EXPECT_GT(interventions, 100u);
+}
+
+TEST(HypothesisMonitor, LogDomainUpdatesMatch)
+{
+  auto samples = recordedSequence(20000);
+  auto linear = parameters(false);
+  auto log_domain = parameters(true);
+
+  cube::Hypothesis a(20.0, 0.05), b(20.0, 0.05);
+  for(std::size_t i = 0; i < samples.size(); i++)
+  {
+    bool linear_supported = a.update(samples[i].depth, samples[i].uncertainty, linear);
+    bool log_supported = b.update(samples[i].depth, samples[i].uncertainty, log_domain);
+    ASSERT_EQ(linear_supported, log_supported) << "at sample " << i;
+    if(!linear_supported)
+    {
+      a.resetMonitor();
+      b.resetMonitor();
+    }
+  }
+  EXPECT_EQ(a.number_of_samples, b.number_of_samples);
+  EXPECT_EQ(a.current_estimate, b.current_estimate);
+  EXPECT_EQ(a.current_variance, b.current_variance);
+}
+
+TEST(HypothesisMonitor, LogDomainNodeEstimatesMatch)
+{
+  auto samples = recordedSequence(20000);
+  auto linear = parameters(false);
+  auto log_domain = parameters(true);
+
+  cube::Node a, b;
+  for(const auto& s: samples)
+  {
+    a.queueEstimate(s.depth, s.uncertainty, linear);
+    b.queueEstimate(s.depth, s.uncertainty, log_domain);
+  }
+  a.queueFlush(linear);
+  b.queueFlush(log_domain);
+
+  EXPECT_GT(a.hypothesisCount(), 1u);
+  EXPECT_EQ(a.hypothesisCount(), b.hypothesisCount());
+  auto a_values = a.extractValues(linear);
+  auto b_values = b.extractValues(log_domain);
+  EXPECT_EQ(a_values.depth, b_values.depth);
+  EXPECT_EQ(a_values.uncertainty, b_values.uncertainty);
+  EXPECT_EQ(a_values.sample_count, b_values.sample_count);
+}
+
+TEST(HypothesisMonitor, LogThresholdsFollowSettings)
+{
+  auto log_domain = parameters(true);
+  log_domain.set("bayes_factor_threshold", "0.05");
+  log_domain.set("estimate_offset", "3");
+  EXPECT_DOUBLE_EQ(log_domain.logBayesFactorThreshold(), std::log(double(0.05f)));
+  EXPECT_DOUBLE_EQ(log_domain.logBayesFactorOffset(), 4.5);
+
+  auto samples = recordedSequence(5000);
+  auto linear = log_domain;
+  linear.log_domain_monitoring = false;
+  cube::Hypothesis a(20.0, 0.05), b(20.0, 0.05);
+  for(const auto& s: samples)
+  {
+    bool supported = a.monitor(s.depth, s.uncertainty, linear);
+    ASSERT_EQ(supported, b.monitorLogDomain(s.depth, s.uncertainty, log_domain));
+    if(!supported)
+    {
+      a.resetMonitor();
+      b.resetMonitor();
+    }
+  }
+}
+
+TEST(HypothesisMonitor, RejectsInvalidSettings)
+{
+  auto p = parameters(false);
+  EXPECT_THROW(p.set("bayes_factor_threshold", "0"), std::invalid_argument);
+  EXPECT_THROW(p.set("bayes_factor_threshold", "-0.1"), std::invalid_argument);
+  EXPECT_THROW(p.set("discount", "0"), std::invalid_argument);
+  EXPECT_THROW(p.set("discount", "1.5"), std::invalid_argument);
+  EXPECT_THROW(p.set("quotient_limit", "0"), std::invalid_argument);
+  EXPECT_EQ(p.bayesFactorThreshold(), 0.135f);
+  EXPECT_EQ(p.discount, 1.0f);
+
+  p.set("minimum_context_search_range", "20");
+  EXPECT_THROW(p.validate(), std::invalid_argument);
+  p.set("maximum_context_search_range", "30");
+  EXPECT_NO_THROW(p.validate());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,306 @@
+#include <cube_bathymetry/simrad_file.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace
+{
+
+typedef std::vector<uint8_t> Bytes;
+
+/// 2020-06-01, and milliseconds since midnight of the first datagram
+const uint32_t DATE = 20200601;
+const uint32_t START = 36000000;
+
+/// Builds EM series raw files in either byte order
+class EmFileGenerator
+{
+public:
+  explicit EmFileGenerator(bool big_endian, uint16_t model = 3002): big_endian_(big_endian), model_(model) {}
+
+  /// Position datagram at milliseconds after START
+  void position(uint32_t milliseconds, double latitude, double longitude, bool active = true)
+  {
+    Bytes body;
+    put<uint16_t>(body, 0);
+    put<uint16_t>(body, 100);
+    put<int32_t>(body, std::lround(latitude*20000000.0));
+    put<int32_t>(body, std::lround(longitude*10000000.0));
+    put<uint16_t>(body, 100);
+    put<uint16_t>(body, 250);
+    put<uint16_t>(body, 0);
+    put<uint16_t>(body, 0);
+    body.push_back(active ? 0x81 : 0x02);
+    body.push_back(0);
+    datagram(0x50, milliseconds, body);
+  }
+
+  /// Depth datagram at milliseconds after START with a heading of 0, a
+  /// resolution of 1 cm and a beam at each across track offset
+  void depth(uint32_t milliseconds, uint16_t raw_depth, const std::vector<int16_t>& across)
+  {
+    Bytes body;
+    put<uint16_t>(body, 1);
+    put<uint16_t>(body, 100);
+    put<uint16_t>(body, 0);
+    put<uint16_t>(body, 15000);
+    put<uint16_t>(body, 0);
+    body.push_back(across.size());
+    body.push_back(across.size());
+    body.push_back(1);
+    body.push_back(1);
+    put<uint16_t>(body, 0);
+    for(auto a: across)
+    {
+      put<uint16_t>(body, raw_depth);
+      put<int16_t>(body, a);
+      put<int16_t>(body, 0);
+      body.insert(body.end(), 10, 0);
+    }
+    body.push_back(0);
+    datagram(0x44, milliseconds, body);
+  }
+
+  void garbage(const Bytes& bytes)
+  {
+    bytes_.insert(bytes_.end(), bytes.begin(), bytes.end());
+  }
+
+  /// Corrupt the last datagram's payload so that its checksum fails
+  void corruptLast()
+  {
+    bytes_[last_ + 20]++;
+  }
+
+  void write(const std::string& filename) const
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes_.data()), bytes_.size());
+  }
+
+private:
+  template<typename T>
+  void put(Bytes& bytes, T value) const
+  {
+    auto u = static_cast<uint64_t>(value);
+    for(std::size_t i = 0; i < sizeof(T); i++)
+      bytes.push_back(u >> 8*(big_endian_ ? sizeof(T)-1-i : i));
+  }
+
+  void datagram(uint8_t type, uint32_t milliseconds, const Bytes& body)
+  {
+    Bytes d;
+    d.push_back(0x02);
+    d.push_back(type);
+    put<uint16_t>(d, model_);
+    put<uint32_t>(d, DATE);
+    put<uint32_t>(d, START + milliseconds);
+    d.insert(d.end(), body.begin(), body.end());
+    uint16_t sum = 0;
+    for(std::size_t i = 1; i < d.size(); i++)
+      sum += d[i];
+    d.push_back(0x03);
+    put<uint16_t>(d, sum);
+    last_ = bytes_.size();
+    put<uint32_t>(bytes_, d.size());
+    bytes_.insert(bytes_.end(), d.begin(), d.end());
+  }
+
+  bool big_endian_;
+  uint16_t model_;
+  Bytes bytes_;
+  std::size_t last_ = 0;
+};
+
+class SimradFile: public testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    char name[] = "/tmp/test_simrad_file_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    filename = name;
+  }
+
+  void TearDown() override
+  {
+    std::remove(filename.c_str());
+  }
+
+  /// Two fixes a second apart around a ping of three beams 20 m deep
+  void survey(EmFileGenerator& generator)
+  {
+    generator.position(0, 45.0, -69.0);
+    generator.depth(500, 2000, {-1000, 0, 1000});
+    generator.position(1000, 45.0001, -69.0);
+  }
+
+  std::string filename;
+};
+
+/// Bytes with a stray STX and ETX, but nothing that is a datagram
+Bytes noise(std::size_t size)
+{
+  Bytes ret;
+  for(std::size_t i = 0; i < size; i++)
+    ret.push_back(i%5 == 0 ? 0x02 : i%7 == 0 ? 0x03 : i*37 + 11);
+  return ret;
+}
+
+} // namespace
+
+TEST_F(SimradFile, ReadsBothByteOrders)
+{
+  cube::LocalProjection projection(45.0, -69.0);
+  std::vector<cube::Sounding> soundings[2];
+  for(bool big_endian: {false, true})
+  {
+    EmFileGenerator generator(big_endian);
+    survey(generator);
+    generator.write(filename);
+
+    cube::SimradFile file(filename);
+    ASSERT_EQ(file.pingCount(), 1u);
+    EXPECT_EQ(file.skippedBytes(), 0u);
+    ASSERT_TRUE(file.decodePing(0, projection, cube::SimradReaderOptions(), soundings[big_endian]));
+
+    double latitude, longitude;
+    ASSERT_TRUE(cube::SimradFile::firstPosition(filename, latitude, longitude));
+    EXPECT_NEAR(latitude, 45.0, 1e-7);
+    EXPECT_NEAR(longitude, -69.0, 1e-7);
+  }
+
+  ASSERT_EQ(soundings[0].size(), 3u);
+  ASSERT_EQ(soundings[1].size(), 3u);
+  auto middle = projection.project(45.00005, -69.0);
+  for(std::size_t i = 0; i < 3; i++)
+  {
+    EXPECT_FLOAT_EQ(soundings[0][i].x, soundings[1][i].x);
+    EXPECT_FLOAT_EQ(soundings[0][i].y, soundings[1][i].y);
+    EXPECT_FLOAT_EQ(soundings[0][i].depth, 20.0);
+    EXPECT_FLOAT_EQ(soundings[1][i].depth, 20.0);
+    EXPECT_NEAR(soundings[0][i].x, middle.x + 10.0*(int(i) - 1), 1e-3);
+    EXPECT_NEAR(soundings[0][i].y, middle.y, 1e-3);
+  }
+}
+
+TEST_F(SimradFile, SkipsGarbage)
+{
+  for(bool big_endian: {false, true})
+  {
+    EmFileGenerator generator(big_endian);
+    generator.garbage(noise(100));
+    generator.position(0, 45.0, -69.0);
+    generator.garbage(noise(37));
+    generator.depth(500, 2000, {0});
+    generator.garbage(noise(1));
+    generator.position(1000, 45.0001, -69.0);
+    generator.write(filename);
+
+    cube::SimradFile file(filename);
+    EXPECT_EQ(file.pingCount(), 1u);
+    EXPECT_EQ(file.skippedBytes(), 138u);
+    std::vector<cube::Sounding> soundings;
+    EXPECT_TRUE(file.decodePing(0, cube::LocalProjection(45.0, -69.0), cube::SimradReaderOptions(), soundings));
+  }
+}
+
+TEST_F(SimradFile, ChecksumRequiredAfterGarbage)
+{
+  for(bool big_endian: {false, true})
+  {
+    /* A corrupt ping found while resynchronising is skipped, but one
+     * straight after a good datagram is kept
+     */
+    EmFileGenerator generator(big_endian);
+    survey(generator);
+    generator.garbage(noise(3));
+    generator.depth(600, 2000, {0});
+    generator.corruptLast();
+    /* Header, depth header, one beam, multiplier and tail */
+    std::size_t corrupt_length = 16 + 16 + 16 + 1 + 3;
+    generator.position(650, 45.00005, -69.0);
+    generator.depth(700, 2000, {0});
+    generator.corruptLast();
+    generator.write(filename);
+
+    cube::SimradFile file(filename);
+    EXPECT_EQ(file.pingCount(), 2u);
+    EXPECT_EQ(file.skippedBytes(), 3u + corrupt_length);
+  }
+}
+
+TEST_F(SimradFile, ThrowsAfterTooMuchGarbage)
+{
+  EmFileGenerator generator(false);
+  generator.position(0, 45.0, -69.0);
+  generator.garbage(noise(1025));
+  generator.position(1000, 45.0001, -69.0);
+  generator.write(filename);
+  EXPECT_THROW(cube::SimradFile file(filename), std::runtime_error);
+
+  EmFileGenerator nothing(true);
+  nothing.garbage(noise(200));
+  nothing.write(filename);
+  EXPECT_THROW(cube::SimradFile file(filename), std::runtime_error);
+}
+
+TEST_F(SimradFile, UsesActivePositioningSystem)
+{
+  for(bool big_endian: {false, true})
+  {
+    /* A second system 0.01 degrees north, logged but not active */
+    EmFileGenerator generator(big_endian);
+    generator.position(0, 45.01, -69.0, false);
+    generator.position(0, 45.0, -69.0);
+    generator.position(500, 45.01, -69.0, false);
+    generator.depth(500, 2000, {0});
+    generator.position(1000, 45.0001, -69.0);
+    generator.position(1000, 45.0101, -69.0, false);
+    generator.write(filename);
+
+    double latitude, longitude;
+    ASSERT_TRUE(cube::SimradFile::firstPosition(filename, latitude, longitude));
+    EXPECT_NEAR(latitude, 45.0, 1e-7);
+
+    cube::LocalProjection projection(45.0, -69.0);
+    cube::SimradFile file(filename);
+    std::vector<cube::Sounding> soundings;
+    ASSERT_TRUE(file.decodePing(0, projection, cube::SimradReaderOptions(), soundings));
+    ASSERT_EQ(soundings.size(), 1u);
+    EXPECT_NEAR(soundings[0].y, projection.project(45.00005, -69.0).y, 1e-3);
+  }
+}
+
+TEST_F(SimradFile, UnsignedDepths)
+{
+  /* 400 m at 1 cm is past the range of a signed depth */
+  for(uint16_t model: {120, 300, 3002})
+  {
+    EmFileGenerator generator(true, model);
+    generator.position(0, 45.0, -69.0);
+    generator.depth(500, 40000, {0});
+    generator.position(1000, 45.0001, -69.0);
+    generator.write(filename);
+
+    cube::SimradFile file(filename);
+    std::vector<cube::Sounding> soundings;
+    ASSERT_TRUE(file.decodePing(0, cube::LocalProjection(45.0, -69.0), cube::SimradReaderOptions(), soundings));
+    ASSERT_EQ(soundings.size(), 1u);
+    EXPECT_FLOAT_EQ(soundings[0].depth, model == 3002 ? (40000 - 65536)/100.0 : 400.0) << "EM" << model;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,141 @@
+#include <cube_bathymetry/sounding_file.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace
+{
+
+class SoundingFile: public testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    char name[] = "/tmp/test_sounding_file_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    filename = name;
+  }
+
+  void TearDown() override
+  {
+    std::remove(filename.c_str());
+  }
+
+  /// Write a file with the given header fields followed by bytes of zeros
+  void writeRaw(const char* magic, uint32_t version, uint32_t record_size, std::size_t bytes)
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(magic, 8);
+    out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    out.write(reinterpret_cast<const char*>(&record_size), sizeof(record_size));
+    out.write(std::vector<char>(bytes).data(), bytes);
+  }
+
+  std::string filename;
+};
+
+std::vector<cube::Sounding> soundings(std::size_t count)
+{
+  std::vector<cube::Sounding> ret;
+  for(std::size_t i = 0; i < count; i++)
+  {
+    cube::Sounding s;
+    s.x = 500000.25 + i;
+    s.y = 4700000.5 - 2.0*i;
+    s.depth = 20.0 + 0.125*i;
+    s.vertical_error = 0.01*(i+1);
+    s.horizontal_error = 0.25;
+    ret.push_back(s);
+  }
+  return ret;
+}
+
+void expectSame(const std::vector<cube::Sounding>& expected, const cube::MappedSoundingFile& file)
+{
+  ASSERT_EQ(file.size(), expected.size());
+  for(std::size_t i = 0; i < expected.size(); i++)
+  {
+    const auto& s = file.begin()[i];
+    EXPECT_EQ(s.x, expected[i].x);
+    EXPECT_EQ(s.y, expected[i].y);
+    EXPECT_EQ(s.depth, expected[i].depth);
+    EXPECT_EQ(s.vertical_error, expected[i].vertical_error);
+    EXPECT_EQ(s.horizontal_error, expected[i].horizontal_error);
+  }
+}
+
+} // namespace
+
+TEST_F(SoundingFile, RoundTrip)
+{
+  auto expected = soundings(100);
+  cube::writeSoundingFile(filename, expected);
+  EXPECT_TRUE(cube::MappedSoundingFile::isBinary(filename));
+  cube::MappedSoundingFile file(filename);
+  expectSame(expected, file);
+}
+
+TEST_F(SoundingFile, WriterAppendsBatches)
+{
+  auto expected = soundings(100);
+  cube::SoundingFileWriter writer(filename);
+  writer.write(expected.data(), expected.data() + 30);
+  writer.write(expected.data() + 30, expected.data() + 30);
+  writer.write(expected.data() + 30, expected.data() + expected.size());
+  writer.close();
+  cube::MappedSoundingFile file(filename);
+  expectSame(expected, file);
+}
+
+TEST_F(SoundingFile, EmptyFile)
+{
+  cube::writeSoundingFile(filename, {});
+  cube::MappedSoundingFile file(filename);
+  EXPECT_EQ(file.size(), 0u);
+  EXPECT_EQ(file.begin(), file.end());
+}
+
+TEST_F(SoundingFile, RejectsMalformedHeaders)
+{
+  writeRaw("CUBESND", 1, 32, 64);
+  EXPECT_NO_THROW(cube::MappedSoundingFile file(filename));
+
+  writeRaw("CUBEXYZ", 1, 32, 64);
+  EXPECT_FALSE(cube::MappedSoundingFile::isBinary(filename));
+  EXPECT_THROW(cube::MappedSoundingFile file(filename), std::runtime_error);
+
+  writeRaw("CUBESND", 2, 32, 64);
+  EXPECT_THROW(cube::MappedSoundingFile file(filename), std::runtime_error);
+
+  std::ofstream(filename, std::ios::binary) << "CUBESND";
+  EXPECT_THROW(cube::MappedSoundingFile file(filename), std::runtime_error);
+}
+
+TEST_F(SoundingFile, RejectsBadRecordSizes)
+{
+  writeRaw("CUBESND", 1, 24, 48);
+  EXPECT_THROW(cube::MappedSoundingFile file(filename), std::runtime_error);
+
+  /* A truncated last record */
+  writeRaw("CUBESND", 1, 32, 48);
+  EXPECT_THROW(cube::MappedSoundingFile file(filename), std::runtime_error);
+}
+
+TEST(SoundingFileWriter, ThrowsIfUnableToCreate)
+{
+  EXPECT_THROW(cube::SoundingFileWriter writer("/nonexistent/soundings.bin"), std::runtime_error);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}